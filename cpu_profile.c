@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu_profile.h"
+#include "emu.h"
+#include "m68k.h"
+#include "platform.h"
+
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+
+// Maximum depth of the shadow call stack. Deeper calls are accounted to
+// the deepest tracked function.
+#define MAX_DEPTH        64
+
+// Functions whose self cycles are below this threshold (in 1/1000 of total)
+// are not written to the genhle argument list.
+#define MIN_PERMILLE     5
+
+// Maximum number of functions written to the genhle argument list.
+#define MAX_HOT_FUNCS    32
+
+// Statistics for a single function, keyed by entrypoint.
+typedef struct {
+	uint32_t key;                   // function entrypoint
+	uint64_t self_cycles;           // cycles spent in the function body
+	uint64_t total_cycles;          // cycles including callees
+	uint32_t calls;                 // number of calls
+} FuncStats;
+
+// A frame of the shadow call stack.
+typedef struct {
+	uint32_t entry;                 // function entrypoint
+	uint32_t ret;                   // return address (0 for interrupts)
+	uint64_t start;                 // cycle counter at function entry
+} Frame;
+
+static FuncStats *funcs;
+static Frame stack[MAX_DEPTH];
+static int depth;
+static uint64_t last_clock;
+static uint32_t last_pc;
+static uint16_t last_op;
+static int last_ipl;
+
+static FuncStats* func_stats(uint32_t entry) {
+	int idx = hmgeti(funcs, entry);
+	if (idx < 0) {
+		hmputs(funcs, ((FuncStats){ .key = entry }));
+		idx = hmgeti(funcs, entry);
+	}
+	return &funcs[idx];
+}
+
+static void frame_push(uint32_t entry, uint32_t ret, uint64_t clock) {
+	if (depth == MAX_DEPTH) return;
+	stack[depth++] = (Frame){ .entry = entry, .ret = ret, .start = clock };
+	func_stats(entry)->calls++;
+}
+
+static void frame_pop(uint64_t clock) {
+	Frame *f = &stack[--depth];
+	func_stats(f->entry)->total_cycles += clock - f->start;
+}
+
+// Return the address following a JSR/BSR instruction at pc, or 0 if the
+// instruction is not a subroutine call.
+static uint32_t call_return_address(uint32_t pc, uint16_t op) {
+	if ((op & 0xFF00) == 0x6100)        // bsr
+		return pc + ((op & 0xFF) == 0 ? 4 : 2);
+	if ((op & 0xFFC0) == 0x4E80) {      // jsr
+		switch ((op >> 3) & 7) {
+		case 2: return pc + 2;          // (An)
+		case 5: case 6: return pc + 4;  // (d16,An), (d8,An,Xn)
+		case 7: return pc + ((op & 7) == 1 ? 6 : 4);  // abs.l / abs.w, pc-relative
+		}
+	}
+	return 0;
+}
+
+// Return true if the instruction can modify the interrupt mask in SR.
+static bool op_modifies_sr(uint16_t op) {
+	return (op & 0xFFC0) == 0x46C0 ||   // move to sr
+		op == 0x007C || op == 0x027C || op == 0x0A7C ||  // ori/andi/eori to sr
+		op == 0x4E73;                   // rte
+}
+
+static void cpu_profile_hook(unsigned int pc) {
+	uint64_t clock = emu_clock() / M68K_CLOCK_DIV;
+	uint16_t op = m68k_read_disassembler_16(pc);
+	int ipl = (m68k_get_reg(NULL, M68K_REG_SR) >> 8) & 7;
+
+	// Account the cycles of the previous instruction to the current function
+	func_stats(depth ? stack[depth-1].entry : 0)->self_cycles += clock - last_clock;
+
+	// Update the shadow call stack depending on the previous instruction.
+	uint32_t ret = call_return_address(last_pc, last_op);
+	if (ret) {
+		frame_push(pc, ret, clock);
+	} else if (last_op == 0x4E75 || last_op == 0x4E77) {
+		// rts/rtr: unwind up to the frame that returns here (if any)
+		int i = depth-1;
+		while (i >= 0 && stack[i].ret != pc) i--;
+		if (i >= 0) while (depth > i) frame_pop(clock);
+	} else if (last_op == 0x4E73) {
+		// rte: unwind up to the innermost interrupt frame
+		int i = depth-1;
+		while (i >= 0 && stack[i].ret != 0) i--;
+		if (i >= 0) while (depth > i) frame_pop(clock);
+	}
+
+	// An interrupt raises the interrupt mask in SR. Treat the handler as
+	// a function, that will be closed by its rte.
+	if (ipl > last_ipl && !op_modifies_sr(last_op))
+		frame_push(pc, 0, clock);
+
+	last_clock = clock;
+	last_pc = pc;
+	last_op = op;
+	last_ipl = ipl;
+}
+
+void cpu_profile_start(void) {
+	hmfree(funcs);
+	depth = 0;
+	last_clock = emu_clock() / M68K_CLOCK_DIV;
+	last_pc = 0;
+	last_op = 0;
+	last_ipl = (m68k_get_reg(NULL, M68K_REG_SR) >> 8) & 7;
+	m68k_set_instr_hook_callback(cpu_profile_hook);
+}
+
+static int cmp_self_cycles(const void *a, const void *b) {
+	const FuncStats *fa = a, *fb = b;
+	return (fb->self_cycles > fa->self_cycles) - (fb->self_cycles < fa->self_cycles);
+}
+
+// Stop profiling, print a report of the hottest functions, and write the
+// list of the hottest ones to outfn, as command line arguments for genhle.
+void cpu_profile_stop(const char *romdir, const char *outfn) {
+	m68k_set_instr_hook_callback(NULL);
+	uint64_t clock = emu_clock() / M68K_CLOCK_DIV;
+	while (depth > 0) frame_pop(clock);
+
+	int n = hmlen(funcs);
+	FuncStats *sorted = malloc(n * sizeof(FuncStats));
+	memcpy(sorted, funcs, n * sizeof(FuncStats));
+	qsort(sorted, n, sizeof(FuncStats), cmp_self_cycles);
+
+	uint64_t total = 0;
+	for (int i=0; i<n; i++) total += sorted[i].self_cycles;
+	if (!total) total = 1;
+	for (int i=0; i<n; i++)
+		if (!sorted[i].key) sorted[i].total_cycles = total;
+
+	printf("[PROFILE] hot functions (%d functions, %llu cycles)\n", n, (unsigned long long)total);
+	printf("[PROFILE] %4s %8s %8s %8s %10s\n", "rank", "func", "self%", "total%", "calls");
+	for (int i=0; i<n && i<MAX_HOT_FUNCS*2; i++) {
+		FuncStats *f = &sorted[i];
+		char name[16];
+		if (f->key) sprintf(name, "%06x", (unsigned)f->key);
+		else strcpy(name, "<top>");
+		printf("[PROFILE] %4d %8s %7.2f%% %7.2f%% %10u\n", i+1, name,
+			f->self_cycles * 100.0 / total, f->total_cycles * 100.0 / total, f->calls);
+	}
+
+	// Write the genhle command line. genhle can recompile functions in the
+	// P-ROM (mapped at 0x000000) and in the BIOS (mapped at 0xC00000); other
+	// areas (banked P-ROM, RAM) are skipped.
+	FILE *f = fopen(outfn, "w");
+	assertf(f, "cannot create: %s", outfn);
+	for (int pass=0; pass<2; pass++) {
+		uint32_t base = pass ? 0xC00000 : 0x000000;
+		uint32_t size = pass ? 0x020000 : 0x100000;
+		bool first = true;
+		for (int i=0; i<n && i<MAX_HOT_FUNCS; i++) {
+			if (sorted[i].self_cycles * 1000 / total < MIN_PERMILLE) break;
+			if (sorted[i].key < base || sorted[i].key >= base + size) continue;
+			// Skip the vector table, which is swapped at runtime
+			if (sorted[i].key < 0x80) continue;
+			if (first) {
+				if (pass) fprintf(f, "%sp.bios@c00000", romdir);
+				else      fprintf(f, "%sp.rom", romdir);
+				first = false;
+			}
+			fprintf(f, " %x", (unsigned)sorted[i].key);
+		}
+		if (!first) fprintf(f, "\n");
+	}
+	fclose(f);
+	printf("[PROFILE] genhle arguments written to %s\n", outfn);
+
+	free(sorted);
+	hmfree(funcs);
+}
@@ -0,0 +1,14 @@
+#ifndef CPU_PROFILE_H
+#define CPU_PROFILE_H
+
+// Hot function profiler (PC only).
+//
+// Tracks 68K subroutine calls through the instruction hook, and accounts
+// the cycles spent in each function. The result is a ranked list of the
+// hottest functions, written in a format that can be passed directly
+// to genhle.
+
+void cpu_profile_start(void);
+void cpu_profile_stop(const char *romdir, const char *outfn);
+
+#endif /* CPU_PROFILE_H */
@@ -1,11 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include "emu.h"
 #ifdef N64
 #include "m64k/m64k.h"
 #else
 #include "m68k.h"
+#include "cpu_profile.h"
+#include "lockstep.h"
 #endif
 #include "hw.h"
 #include "video.h"
@@ -61,9 +65,13 @@ m64k_t m64k;
 #endif
 static uint64_t g_clock, g_clock_framebegin;
 static uint64_t m68k_clock;
-static EmuEvent events[MAX_EVENTS];
+static EventQueue events;
+static int current_event = -1;
+static int dispatched_event = -1;       // event whose callback is running
+static bool dispatched_cancelled;       // ...and it cancelled itself
 uint32_t profile_hw_io;
 uint32_t profile_dma_load;
+bool profile_enabled;
 
 static uint64_t m68k_exec(uint64_t clock) {
 	clock /= M68K_CLOCK_DIV;
@@ -79,36 +87,41 @@ static uint64_t m68k_exec(uint64_t clock) {
 }
 
 
-// Return the next event that must be executed
-static EmuEvent* next_event() {
-    EmuEvent *e = NULL;
-    for (int i=0;i<MAX_EVENTS;i++) {
-        if (!events[i].cb) continue;
-        if (!e || events[i].clock < e->clock) e=&events[i];
-    }
-    return e;
+// Stop the current CPU timeslice, so that the scheduler can reconsider
+// which event comes next.
+static void emu_stop_timeslice(void) {
+	#ifdef N64
+	m64k_run_stop(&m64k);
+	#else
+	m68k_end_timeslice();
+	#endif
 }
 
 int emu_add_event(int64_t clock, EmuEventCb cb, void *cbarg) {
-    for (int i=0;i<MAX_EVENTS;i++) {
-        if (events[i].cb) continue;
-        events[i].clock = clock;
-        events[i].cb = cb;
-        events[i].cbarg = cbarg;
-        events[i].current = false;
-        return i;
-    }
-    assert(0);
+	int id = event_queue_add(&events, clock, cb, cbarg);
+
+	// If the new event is scheduled before the one the CPU is currently
+	// running to, stop the timeslice so that it's not missed.
+	if (current_event >= 0 && clock < event_queue_get(&events, current_event)->clock)
+		emu_stop_timeslice();
+	return id;
 }
 
 void emu_change_event(int event_id, int64_t newclock) {
-	events[event_id].clock = newclock;
-	if (events[event_id].current) {
-		#ifdef N64
-		m64k_run_stop(&m64k);
-		#else
-		m68k_end_timeslice();
-		#endif
+	event_queue_change(&events, event_id, newclock);
+	if (current_event >= 0) {
+		if (event_id == current_event || newclock < event_queue_get(&events, current_event)->clock)
+			emu_stop_timeslice();
+	}
+}
+
+void emu_cancel_event(int event_id) {
+	event_queue_remove(&events, event_id);
+	if (event_id == dispatched_event)
+		dispatched_cancelled = true;
+	if (event_id == current_event) {
+		current_event = -1;
+		emu_stop_timeslice();
 	}
 }
 
@@ -168,6 +181,55 @@ uint32_t emu_vblank_start(void* arg) {
 
 uint32_t render_time;
 
+// Pipelined rendering (--pipeline): at the render event the video state is
+// snapshotted, and the render thread draws it while the CPU runs the next
+// frame. The frame is presented at the following render event, so this
+// adds one frame of latency. render_time is then the time the CPU waited
+// for the render thread, and render_thread_time (and render_thread_rom)
+// the time it took to draw the last presented frame.
+static bool render_pipeline;
+
+#ifndef N64
+static bool render_pending;
+static SDL_sem *render_kick, *render_finished;
+static uint32_t render_thread_time, render_thread_rom;
+static uint32_t render_thread_busy[2];  // written by the render thread
+
+static int render_thread_main(void *arg) {
+	while (1) {
+		SDL_SemWait(render_kick);
+		uint32_t t0 = TICKS_READ();
+		uint32_t rom0 = profile_dma_load;
+		video_render_snapshot();
+		rom_next_frame();
+		render_thread_busy[0] = TICKS_DISTANCE(t0, TICKS_READ());
+		render_thread_busy[1] = profile_dma_load - rom0;
+		SDL_SemPost(render_finished);
+	}
+	return 0;
+}
+
+static void render_pipeline_start(void) {
+	render_kick = SDL_CreateSemaphore(0);
+	render_finished = SDL_CreateSemaphore(0);
+	assertf(render_kick && render_finished, "cannot create semaphores: %s", SDL_GetError());
+	SDL_Thread *t = SDL_CreateThread(render_thread_main, "emu_render", NULL);
+	assertf(t, "cannot create render thread: %s", SDL_GetError());
+	SDL_DetachThread(t);
+	render_pipeline = true;
+}
+
+// Wait for the frame being drawn by the render thread (if any), and present it
+static void render_pipeline_flush(void) {
+	if (!render_pending) return;
+	SDL_SemWait(render_finished);
+	render_pending = false;
+	render_thread_time = render_thread_busy[0];
+	render_thread_rom = render_thread_busy[1];
+	plat_endframe();
+}
+#endif
+
 uint32_t emu_render(void *arg) {
 
 	#ifdef N64
@@ -199,37 +261,61 @@ uint32_t emu_render(void *arg) {
 	}
 
 	debugf("[RENDER] render\n");
-	#ifdef N64
 	uint32_t t0 = TICKS_READ();
+
+	#ifndef N64
+	if (render_pipeline) {
+		render_pipeline_flush();
+		video_snapshot();
+		plat_beginframe();
+		render_pending = true;
+		SDL_SemPost(render_kick);
+		render_time = TICKS_DISTANCE(t0, TICKS_READ());
+		return FRAME_CLOCK;
+	}
 	#endif
+
 	plat_beginframe();
 	video_render();
 	plat_endframe();
 
 	rom_next_frame();
 
-	#ifdef N64
 	render_time = TICKS_DISTANCE(t0, TICKS_READ());
-	#endif
 
 	return FRAME_CLOCK;
 }
 
 void emu_run_frame(void) {
     uint64_t vsync = g_clock_framebegin + FRAME_CLOCK;
-    EmuEvent *e;
+    int id;
 
     // Run all events that are scheduled before next vsync
-    while ((e = next_event()) && (e->clock < vsync)) {
-    	e->current = true;
-        g_clock = m68k_exec(e->clock);
-        e->current = false;
+    while ((id = event_queue_peek(&events)) >= 0 && event_queue_get(&events, id)->clock < vsync) {
+        current_event = id;
+        g_clock = m68k_exec(event_queue_get(&events, id)->clock);
+
+        // The event might have been cancelled or rescheduled while the CPU
+        // was running: in that case, just pick the next one.
+        if (current_event != id) continue;
+        current_event = -1;
 
         // Call the event callback, and check if it must be repeated.
-        if (g_clock >= e->clock) {    	
+        EmuEvent *e = event_queue_get(&events, id);
+        if (g_clock >= e->clock) {
+	        dispatched_event = id;
+	        dispatched_cancelled = false;
 	        uint32_t repeat = e->cb(e->cbarg);
-	        if (repeat != 0) e->clock += repeat;
-	        else e->cb = NULL;
+	        dispatched_event = -1;
+
+	        // The callback might have cancelled itself; its ID might even
+	        // have been reused by an event added afterwards, which must be
+	        // left alone. The queue might also have been reallocated, so
+	        // fetch the event again.
+	        if (dispatched_cancelled) continue;
+	        e = event_queue_get(&events, id);
+	        if (repeat != 0) event_queue_change(&events, id, e->clock + repeat);
+	        else event_queue_remove(&events, id);
         }
     }
 
@@ -242,23 +328,125 @@ void emu_run_frame(void) {
 	g_clock_framebegin += FRAME_CLOCK;
 }
 
+#ifndef N64
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Benchmark mode: run the emulator as fast as possible for the specified
+// number of frames, without video output and audio, and then print
+// a summary of the performance.
+static void bench_run(int nframes) {
+	uint32_t *frame_time = malloc(nframes * sizeof(uint32_t));
+	uint64_t total_time = 0, total_io = 0, total_render = 0, total_rom = 0;
+	uint64_t total_thread = 0, total_thread_rom = 0;
+	assertf(frame_time, "memory allocation failed");
+
+	profile_enabled = true;
+	m68k_reset_hle_stats();
+	for (int i=0; i<nframes; i++) {
+		render_time = 0;
+		render_thread_time = render_thread_rom = 0;
+		profile_hw_io = 0;
+		if (!render_pipeline)
+			profile_dma_load = 0;
+
+		uint32_t t0 = TICKS_READ();
+		emu_run_frame();
+		if (!render_pipeline)
+			rom_next_frame();
+		frame_time[i] = TICKS_DISTANCE(t0, TICKS_READ());
+
+		total_time += frame_time[i];
+		total_io += profile_hw_io;
+		total_render += render_time;
+		if (!render_pipeline)
+			total_rom += profile_dma_load;
+		total_thread += render_thread_time;
+		total_thread_rom += render_thread_rom;
+		plat_poll();
+	}
+	render_pipeline_flush();
+	profile_enabled = false;
+
+	// ROM loading happens while rendering, and HW I/O while running the CPU,
+	// so subtract them to obtain the time spent in each stage.
+	uint64_t total_cpu = total_time - total_render - total_io;
+	uint64_t total_draw = total_render - total_rom;
+	#define PCT(t) ((double)(t) * 100.0 / (double)total_time)
+	#define MS(t)  ((double)(t) * 1000.0 / (double)TICKS_PER_SECOND)
+
+	qsort(frame_time, nframes, sizeof(uint32_t), cmp_u32);
+	uint32_t p99 = frame_time[(nframes * 99 + 99) / 100 - 1];
+
+	printf("[BENCH] frames:%d time:%.3fs fps:%.1f mean:%.3fms p99:%.3fms\n",
+		nframes, MS(total_time) / 1000.0, nframes * 1000.0 / MS(total_time),
+		MS(total_time) / nframes, MS(p99));
+	printf("[BENCH] cpu:%.2f%% io:%.2f%% draw:%.2f%% rom:%.2f%%\n",
+		PCT(total_cpu), PCT(total_io), PCT(total_draw), PCT(total_rom));
+	if (render_pipeline)
+		printf("[BENCH] render thread: draw:%.2f%% rom:%.2f%% (draw above is the wait)\n",
+			PCT(total_thread - total_thread_rom), PCT(total_thread_rom));
+
+	#if M68K_HLE
+	unsigned int hle_calls; unsigned long long hle_cycles, interp_cycles;
+	m68k_get_hle_stats(&hle_calls, &hle_cycles, &interp_cycles);
+	printf("[BENCH] 68k cycles: hle:%.2f%% interp:%.2f%% (hle calls:%u)\n",
+		hle_cycles * 100.0 / (hle_cycles + interp_cycles),
+		interp_cycles * 100.0 / (hle_cycles + interp_cycles), hle_calls);
+	#endif
+
+	#undef PCT
+	#undef MS
+	free(frame_time);
+}
+#endif
+
 int main(int argc, char *argv[]) {
 	#ifndef N64
-	if (argc < 2) {
-		fprintf(stderr, "Usage:\n    mvs64 <romdir>\n");
+	int bench_frames = 0;
+	const char *romdir = NULL;
+	const char *hotfuncs = NULL;
+	bool lockstep = false;
+	bool pipeline = false;
+	bool badargs = false;
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "--bench")) {
+			char *end = NULL;
+			long n = i+1 < argc ? strtol(argv[++i], &end, 10) : 0;
+			if (!end || end == argv[i] || *end || n <= 0 || n > INT_MAX)
+				badargs = true;
+			else
+				bench_frames = n;
+		} else if (!strcmp(argv[i], "--nohle"))
+			m68k_set_hle_enabled(false);
+		else if (!strcmp(argv[i], "--hotfuncs") && i+1 < argc)
+			hotfuncs = argv[++i];
+		else if (!strcmp(argv[i], "--lockstep"))
+			lockstep = true;
+		else if (!strcmp(argv[i], "--pipeline"))
+			pipeline = true;
+		else
+			romdir = argv[i];
+	}
+	if (!romdir || badargs) {
+		fprintf(stderr, "Usage:\n    mvs64 [--bench <frames>] [--nohle] [--hotfuncs <file>] [--lockstep] [--pipeline] <romdir>\n");
 		return 1;
 	}
 	#else 
 	argc = 0; argv = NULL;
+	const int bench_frames = 0;
 	#endif
 
-	plat_init(44100, FPS);
-	plat_enable_video(true);
+	// In benchmark mode, there is no audio and no video output.
+	plat_init(bench_frames ? 0 : 44100, FPS);
+	plat_enable_video(!bench_frames);
 
 	#ifdef N64
 	rom_load("rom:/");
 	#else
-	rom_load(argv[1]);
+	rom_load(romdir);
 	#endif
 
 	#ifdef N64
@@ -268,6 +456,7 @@ int main(int argc, char *argv[]) {
 	m68k_init();
 	#endif
 
+	event_queue_init(&events, MAX_EVENTS);
 	hw_init();
 	g_clock = 0;
 
@@ -282,6 +471,23 @@ int main(int argc, char *argv[]) {
 	emu_add_event(LINE_CLOCK*24,  emu_render, NULL);
 	emu_add_event(LINE_CLOCK*248, emu_vblank_start, NULL);
 
+	#ifndef N64
+	if (hotfuncs)
+		cpu_profile_start();
+	if (lockstep)
+		lockstep_start();
+	if (pipeline)
+		render_pipeline_start();
+	if (bench_frames) {
+		bench_run(bench_frames);
+		if (hotfuncs)
+			cpu_profile_stop(romdir, hotfuncs);
+		if (lockstep)
+			lockstep_stop();
+		return 0;
+	}
+	#endif
+
 	#ifdef N64
 	uint32_t fps_frame = 0;
 	uint32_t fps_time = TICKS_READ();
@@ -289,8 +495,8 @@ int main(int argc, char *argv[]) {
 	while (1) {
 		render_time = 0;
 		profile_hw_io = 0;
-		profile_dma_load = 0;
 		#ifdef N64
+		profile_dma_load = 0;
 		uint32_t t0 = TICKS_READ();
 		#endif
 		emu_run_frame();
@@ -311,7 +517,8 @@ int main(int argc, char *argv[]) {
 			#endif
 		#endif
 
-		rom_next_frame();
+		if (!render_pipeline)
+			rom_next_frame();
 		#ifdef N64
 		uint32_t curtime = TICKS_READ();
 		if (TICKS_DISTANCE(fps_time, curtime) > TICKS_FROM_MS(1000)) {
@@ -323,6 +530,11 @@ int main(int argc, char *argv[]) {
 	}
 
 	debugf("end\n");
+	#ifndef N64
+	render_pipeline_flush();
+	if (hotfuncs)
+		cpu_profile_stop(romdir, hotfuncs);
+	#endif
 	cpu_start_trace(1000);
 	m68k_exec(g_clock+100);
 
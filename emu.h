@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "event_queue.h"
 
 #define MVS_CLOCK         24000000
 #define M68K_CLOCK_DIV    2
@@ -17,19 +18,12 @@
 #define LINE_CLOCK        (FRAME_CLOCK / 264)
 #define WATCHDOG_PERIOD   3244030
 
-#define MAX_EVENTS 8
-
-typedef uint32_t (*EmuEventCb)(void *cbarg);
-
-typedef struct {
-    int64_t clock;
-    EmuEventCb cb;
-    void *cbarg;
-    bool current;
-} EmuEvent;
+// Number of events preallocated in the scheduler (it grows on demand)
+#define MAX_EVENTS 32
 
 int emu_add_event(int64_t clock, EmuEventCb cb, void *cbarg);
 void emu_change_event(int event_id, int64_t clock);
+void emu_cancel_event(int event_id);
 int64_t emu_clock(void);
 int64_t emu_clock_frame(void);
 uint32_t emu_pc(void);
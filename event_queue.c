@@ -0,0 +1,121 @@
+#include "event_queue.h"
+#include <stdlib.h>
+#include <assert.h>
+
+// Return true if event a must be executed before event b. Events scheduled
+// at the same clock are executed in ID order, so that the order is stable
+// and does not depend on the heap layout.
+static inline bool event_before(EventQueue *q, int a, int b) {
+	EmuEvent *ea = &q->events[a], *eb = &q->events[b];
+	if (ea->clock != eb->clock) return ea->clock < eb->clock;
+	return a < b;
+}
+
+static inline void heap_set(EventQueue *q, int idx, int id) {
+	q->heap[idx] = id;
+	q->events[id].heapidx = idx;
+}
+
+static void heap_sift_up(EventQueue *q, int idx) {
+	int id = q->heap[idx];
+	while (idx > 0) {
+		int parent = (idx-1) / 2;
+		if (!event_before(q, id, q->heap[parent])) break;
+		heap_set(q, idx, q->heap[parent]);
+		idx = parent;
+	}
+	heap_set(q, idx, id);
+}
+
+static void heap_sift_down(EventQueue *q, int idx) {
+	int id = q->heap[idx];
+	while (1) {
+		int child = idx*2+1;
+		if (child >= q->num_events) break;
+		if (child+1 < q->num_events && event_before(q, q->heap[child+1], q->heap[child]))
+			child++;
+		if (!event_before(q, q->heap[child], id)) break;
+		heap_set(q, idx, q->heap[child]);
+		idx = child;
+	}
+	heap_set(q, idx, id);
+}
+
+static void event_queue_grow(EventQueue *q) {
+	int oldcap = q->capacity;
+	q->capacity = oldcap ? oldcap*2 : 8;
+
+	q->events = realloc(q->events, sizeof(EmuEvent) * q->capacity);
+	q->heap = realloc(q->heap, sizeof(int) * q->capacity);
+	q->free_ids = realloc(q->free_ids, sizeof(int) * q->capacity);
+	assert(q->events && q->heap && q->free_ids);
+
+	// Push new IDs in reverse order, so that lower IDs are allocated first.
+	for (int i=q->capacity-1; i>=oldcap; i--) {
+		q->events[i] = (EmuEvent){ .cb = NULL, .heapidx = -1 };
+		q->free_ids[q->num_free++] = i;
+	}
+}
+
+// Initialize an event queue, preallocating the specified number of events.
+void event_queue_init(EventQueue *q, int capacity) {
+	*q = (EventQueue){0};
+	while (q->capacity < capacity)
+		event_queue_grow(q);
+}
+
+void event_queue_free(EventQueue *q) {
+	free(q->events);
+	free(q->heap);
+	free(q->free_ids);
+	*q = (EventQueue){0};
+}
+
+// Add a new event to the queue. Return the event ID.
+int event_queue_add(EventQueue *q, int64_t clock, EmuEventCb cb, void *cbarg) {
+	assert(cb);
+	if (q->num_free == 0)
+		event_queue_grow(q);
+
+	int id = q->free_ids[--q->num_free];
+	EmuEvent *e = &q->events[id];
+	e->clock = clock;
+	e->cb = cb;
+	e->cbarg = cbarg;
+
+	heap_set(q, q->num_events++, id);
+	heap_sift_up(q, e->heapidx);
+	return id;
+}
+
+// Reschedule an existing event at a different clock.
+void event_queue_change(EventQueue *q, int id, int64_t clock) {
+	EmuEvent *e = &q->events[id];
+	assert(e->cb && e->heapidx >= 0);
+
+	int64_t oldclock = e->clock;
+	e->clock = clock;
+	if (clock < oldclock)
+		heap_sift_up(q, e->heapidx);
+	else
+		heap_sift_down(q, e->heapidx);
+}
+
+// Remove an event from the queue. Its ID becomes invalid and will be
+// recycled by a later event_queue_add.
+void event_queue_remove(EventQueue *q, int id) {
+	EmuEvent *e = &q->events[id];
+	assert(e->cb && e->heapidx >= 0);
+
+	int idx = e->heapidx;
+	int last = q->heap[--q->num_events];
+	if (idx != q->num_events) {
+		heap_set(q, idx, last);
+		heap_sift_up(q, idx);
+		heap_sift_down(q, q->events[last].heapidx);
+	}
+
+	e->cb = NULL;
+	e->heapidx = -1;
+	q->free_ids[q->num_free++] = id;
+}
@@ -0,0 +1,51 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint32_t (*EmuEventCb)(void *cbarg);
+
+// A scheduled event. Events are referred to by their ID, which is stable for
+// the whole lifetime of the event (until it is removed from the queue).
+typedef struct {
+	int64_t clock;                  // clock at which the event must trigger
+	EmuEventCb cb;                  // callback (NULL if the slot is free)
+	void *cbarg;                    // argument passed to the callback
+	int heapidx;                    // position in the heap (-1 if not scheduled)
+} EmuEvent;
+
+// A priority queue of events, sorted by clock.
+//
+// It is implemented as a binary min-heap of event IDs. Events themselves
+// are stored in a separate array that is indexed by ID, so that IDs remain
+// valid while the heap is reorganized. The queue grows on demand, so there
+// is no hard limit to the number of events.
+typedef struct {
+	EmuEvent *events;               // event slots (indexed by ID)
+	int *heap;                      // binary min-heap of event IDs
+	int *free_ids;                  // stack of free event IDs
+	int num_events;                 // number of scheduled events (heap size)
+	int num_free;                   // number of free IDs in free_ids
+	int capacity;                   // number of allocated event slots
+} EventQueue;
+
+void event_queue_init(EventQueue *q, int capacity);
+void event_queue_free(EventQueue *q);
+int event_queue_add(EventQueue *q, int64_t clock, EmuEventCb cb, void *cbarg);
+void event_queue_change(EventQueue *q, int id, int64_t clock);
+void event_queue_remove(EventQueue *q, int id);
+
+// Return the ID of the next event that must be executed, or -1 if the queue
+// is empty.
+static inline int event_queue_peek(EventQueue *q) {
+	return q->num_events ? q->heap[0] : -1;
+}
+
+// Return the event with the specified ID. Notice that the returned pointer
+// is invalidated by event_queue_add, as the queue might be reallocated.
+static inline EmuEvent* event_queue_get(EventQueue *q, int id) {
+	return &q->events[id];
+}
+
+#endif /* EVENT_QUEUE_H */
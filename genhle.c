@@ -9,6 +9,26 @@
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
+// A ROM image loaded in the 68K address space.
+typedef struct {
+	uint8_t *data;
+	uint32_t base;
+	uint32_t size;
+} RomImage;
+
+RomImage *images = NULL;
+
+// Find the ROM image containing the specified address. Returns NULL if the
+// address is not within any loaded image (eg: RAM, banked P-ROM).
+RomImage* find_image(uint32_t addr) {
+	for (int i=0;i<arrlen(images);i++)
+		if (addr >= images[i].base && addr < images[i].base + images[i].size)
+			return &images[i];
+	return NULL;
+}
+
+// Decode an opcode into the interpreter handler. Returns NULL for opcodes
+// that are illegal (they are not part of the table).
 const opcode_handler_struct* decode_opcode(uint16_t op) {
 	const int len = sizeof(m68k_opcode_handler_table) / sizeof(opcode_handler_struct);
 
@@ -17,8 +37,7 @@ const opcode_handler_struct* decode_opcode(uint16_t op) {
 		if ((op & s->mask) == s->match)
 			return s;
 	}
-	fprintf(stderr, "unknown opcode: %02x\n", op);
-	exit(1);
+	return NULL;
 }
 
 #define be16(a)  (((uint16_t)((a)[0]) << 8) | (a)[1])
@@ -128,8 +147,9 @@ bool find_word_prefix(char *s, char *prefix, char *out) {
 // opcode also encodes different branch targets), but they need to be "similar
 // enough"; we approximate this with "emulated using the same function in the
 // interpreter".
-bool decode_duffdevice(unsigned char *rom, unsigned int pc, int *ddlen, int *ddstep) {
+bool decode_duffdevice(RomImage *img, unsigned int pc, int *ddlen, int *ddstep) {
 	char disasm[256]; 
+	const uint8_t *rom = img->data - img->base;
 
 	#define MAX_DD_STEP 4
 	uint16_t op[MAX_DD_STEP+1]; const opcode_handler_struct *oph[MAX_DD_STEP+1]; int oplen[MAX_DD_STEP+1];
@@ -141,6 +161,7 @@ bool decode_duffdevice(unsigned char *rom, unsigned int pc, int *ddlen, int *dds
 		op[i] = be16(rom + nextpc);
 		oplen[i] = m68k_disassemble_raw(disasm, nextpc, rom+nextpc, NULL, M68K_CPU_TYPE_68000);
 		oph[i] = decode_opcode(op[i]);
+		if (!oph[i]) return false;
 
 		if (i != 0 && oph[i] == oph[0]) {
 			*ddstep = nextpc-pc;
@@ -149,11 +170,12 @@ bool decode_duffdevice(unsigned char *rom, unsigned int pc, int *ddlen, int *dds
 
 		nextpc += oplen[i];
 	}
-	if (*ddstep < 0) return -1;
+	if (*ddstep < 0) return false;
 
 	// See how long the sequence is. Iterate until we find a different instruction.
 	*ddlen = 2;
-	while (decode_opcode(be16(rom + pc + *ddlen * *ddstep)) == oph[0]) {
+	while (pc + *ddlen * *ddstep + 2 <= img->base + img->size &&
+		   decode_opcode(be16(rom + pc + *ddlen * *ddstep)) == oph[0]) {
 		*ddlen = *ddlen + 1;
 		if (*ddlen == 1000) panic("decode_duffdevice: endless sequence at %x", pc);
 	}
@@ -206,30 +228,748 @@ bool find_perfect_hash(uint32_t *nums, int sz, uint32_t* ph_mul, uint32_t* ph_sh
 	return false;
 }
 
-unsigned char *load_rom(const char *fn) {
+unsigned char *load_rom(const char *fn, size_t *size) {
 	FILE *f = fopen(fn, "rb"); if (!f) panic("Cannot open: %s\n", fn);
 	fseek(f, 0, SEEK_END); size_t prom_size = ftell(f);
 	unsigned char *rom = malloc(prom_size);
 	fseek(f, 0, SEEK_SET);
 	fread(rom, 1, prom_size, f);
 	fclose(f);
+	*size = prom_size;
 	return rom;
 }
 
+// Interpreter helpers that are not available to recompiled code (see
+// m68k_recompiler.h). Opcodes using them (exceptions, SR changes, stop)
+// are left to the interpreter.
+static const char *unsupported_helpers[] = {
+	"m68ki_exception_", "m68ki_init_exception", "m68ki_stack_frame_", "m68ki_jump_vector",
+	"m68ki_set_sr", "m68ki_set_s_flag", "m68ki_set_sm_flag", "m68ki_check_interrupts",
+	"m68ki_fake_push_", "m68ki_fake_pull_", "m68ki_branch_32", "m68ki_illg_callback",
+	"CPU_STOPPED", NULL
+};
+
+// Handler code that reads REG_PC: PC-relative addressing, and memory accesses
+// (hardware handlers can observe the PC). REG_PC must be valid before
+// these opcodes, while it can be left stale elsewhere within a function.
+// Memory accesses proven to hit RAM or ROM do not need it.
+static const char *pc_readers[] = {
+	"REG_PC", "_PCDI", "_PCIX", "m68ki_get_ea_pc", "m68ki_push_", "m68ki_pull_", NULL
+};
+static const char *mem_accessors[] = {
+	"m68ki_read_", "m68ki_write_", "OPER_A", NULL
+};
+
+bool stranysubstr(const char *s, const char **subs) {
+	while (*subs) {
+		if (strstr(s, *subs))
+			return true;
+		subs++;
+	}
+	return false;
+}
+
+// If the handler is a branch (Bcc, BRA, DBcc), return the size of its
+// displacement (8 or 16). Otherwise, return 0.
+int branch_size(const char *handler) {
+	const char *name = handler + strlen("m68k_op_");
+	const char *sfx = strchr(name, '_');
+	if (!sfx) return 0;
+	int n = sfx - name;
+	bool bcc = name[0] == 'b' && n == 3 && strncmp(name, "bsr", 3);
+	bool dbcc = name[0] == 'd' && name[1] == 'b' && (n == 3 || n == 4);
+	if (!bcc && !dbcc) return 0;
+	if (!strcmp(sfx, "_8")) return 8;
+	if (!strcmp(sfx, "_16")) return 16;
+	return 0;
+}
+
+// Return the target of a subroutine call or jump (bsr, jsr, jmp), if it can
+// be statically resolved (absolute or pc-relative addressing). Otherwise,
+// return 0.
+uint32_t call_target(uint32_t pc, const uint8_t *func) {
+	uint16_t op = be16(func);
+	if ((op & 0xFF00) == 0x6100) {
+		if ((op & 0xFF) == 0x00) return pc + 2 + (int16_t)be16(func+2);
+		if ((op & 0xFF) == 0xFF) return 0;
+		return pc + 2 + (int8_t)op;
+	}
+	if ((op & 0xFF80) == 0x4E80) {
+		switch (op & 0x3F) {
+		case 0x38: return (uint32_t)(int16_t)be16(func+2) & 0xFFFFFF;
+		case 0x39: return be32(func+2) & 0xFFFFFF;
+		case 0x3A: return pc + 2 + (int16_t)be16(func+2);
+		}
+	}
+	return 0;
+}
+
+// Map of the bodies of all opcode handlers, parsed from m68kops.c
+struct { char *key; char *value; } *op_interpreter;
+
+// Flags of the condition code register, as tracked by the flag liveness analysis.
+enum { FX = 1<<0, FN = 1<<1, FZ = 1<<2, FV = 1<<3, FC = 1<<4, FALL = 0x1F };
+
+// A recompiled instruction. The generated code is kept in pieces, so that
+// it can be optimized once the whole function has been decoded.
+typedef struct {
+	uint32_t pc;
+	char *label;                    // label and comments
+	char *operands;                 // opcode and operands
+	char *body;                     // handler body
+	const char *tail;               // exit and closing brace
+	uint32_t next_pc;               // pc of the following opcode
+	int cycles;                     // base cycles of the opcode
+	bool needs_pc;                  // the body reads REG_PC (or can observe it)
+	bool io;                        // might access the hardware (or observe the clock)
+	bool ends_block;                // last instruction of a basic block
+	bool starts_block;              // first instruction of a basic block
+	uint32_t *succs;                // successors within the function
+	bool exits;                     // can exit to the interpreter
+	bool stub;                      // not recompiled (left to the interpreter)
+	uint8_t use;                    // flags read before being written
+	uint8_t kill;                   // flags written on all paths
+	uint8_t reads;                  // flags read anywhere
+	uint8_t live_out;               // flags live after the instruction
+} Insn;
+
+// Return the flags read by the macros used in handler bodies to access them.
+uint8_t macro_flag_reads(const char *id, int len) {
+	static const struct { const char *name; uint8_t flags; } macros[] = {
+		{ "COND_CS", FC }, { "COND_CC", FC }, { "COND_VS", FV }, { "COND_VC", FV },
+		{ "COND_NE", FZ }, { "COND_EQ", FZ }, { "COND_MI", FN }, { "COND_PL", FN },
+		{ "COND_LT", FN|FV }, { "COND_GE", FN|FV }, { "COND_HI", FC|FZ }, { "COND_LS", FC|FZ },
+		{ "COND_GT", FN|FV|FZ }, { "COND_LE", FN|FV|FZ }, { "COND_XS", FX }, { "COND_XC", FX },
+		{ "XFLAG_AS_1", FX }, { "NFLAG_AS_1", FN }, { "VFLAG_AS_1", FV }, { "ZFLAG_AS_1", FZ }, { "CFLAG_AS_1", FC },
+		{ "m68ki_get_ccr", FALL }, { "m68ki_get_sr", FALL },
+	};
+
+	char name[64];
+	if (len >= sizeof(name)) return 0;
+	memcpy(name, id, len); name[len] = 0;
+	// COND_NOT_XX reads the same flags of COND_XX
+	if (strstartwith(name, "COND_NOT_")) memmove(name+5, name+9, len-9+1);
+	for (int i=0;i<sizeof(macros)/sizeof(macros[0]);i++)
+		if (!strcmp(name, macros[i].name))
+			return macros[i].flags;
+	return 0;
+}
+
+// Analyze how a handler body accesses the flags. Assignments to the flags
+// in strip are removed from the body.
+//
+// A flag is killed if it is assigned at the top level of the body, before
+// any goto (which might skip the assignment). Compound assignments (eg: |=)
+// count as reads.
+void analyze_flags(char *body, uint8_t strip, uint8_t *use, uint8_t *kill, uint8_t *reads) {
+	static const char flagnames[] = "XNZVC";
+	int depth = 0; bool jumped = false;
+	*use = *kill = *reads = 0;
+
+	char *p = body;
+	while (*p) {
+		if (*p == '{') depth++;
+		if (*p == '}') depth--;
+		if (!isalpha(*p) && *p != '_') { p++; continue; }
+
+		char *id = p;
+		while (isalnum(*p) || *p == '_') p++;
+		int len = p - id;
+
+		uint8_t f = 0;
+		if (len == 6 && strstartwith(id, "FLAG_") && strchr(flagnames, id[5]))
+			f = 1 << (strchr(flagnames, id[5]) - flagnames);
+
+		if (f) {
+			char *q = p;
+			while (*q == ' ' || *q == '\t') q++;
+			if (q[0] == '=' && q[1] != '=') {
+				if (!depth && !jumped) *kill |= f;
+				if (strip & f) {
+					// Remove "FLAG_x = ", and rescan from there (there might be
+					// a chained assignment)
+					q++; while (*q == ' ' || *q == '\t') q++;
+					memmove(id, q, strlen(q)+1);
+					p = id;
+				}
+				continue;
+			}
+		} else if (len == 4 && !strncmp(id, "goto", 4)) {
+			jumped = true;
+			continue;
+		} else if (len == 13 && !strncmp(id, "m68ki_set_ccr", 13)) {
+			if (!depth && !jumped) *kill |= FALL;
+			continue;
+		} else {
+			f = macro_flag_reads(id, len);
+		}
+
+		*reads |= f;
+		*use |= f & ~*kill;
+	}
+}
+
+// Compute which flags are live after each instruction, and remove the
+// assignments to the dead ones.
+//
+// Musashi computes all the flags affected by an instruction, but most of them
+// are overwritten by the next instructions before being read. This is a
+// standard backward dataflow analysis over the function: flags are live at
+// every exit to the interpreter (which might read them), at every
+// instruction that is left to the interpreter, and at the start of every
+// basic block, where the function exits when the timeslice is over.
+void strip_dead_flags(Insn *insns, int n) {
+	struct { uint32_t key; int value; } *index = NULL;
+	uint8_t *live_in = calloc(n, 1);
+
+	for (int i=0;i<n;i++) {
+		hmput(index, insns[i].pc, i);
+		if (insns[i].stub)
+			insns[i].use = FALL;
+		else
+			analyze_flags(insns[i].body, 0, &insns[i].use, &insns[i].kill, &insns[i].reads);
+		live_in[i] = insns[i].use | (insns[i].starts_block ? FALL : 0);
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i=n-1;i>=0;i--) {
+			Insn *I = &insns[i];
+			uint8_t out = I->exits ? FALL : 0;
+			for (int j=0;j<arrlen(I->succs);j++) {
+				int idx = hmgeti(index, I->succs[j]);
+				out |= idx >= 0 ? live_in[index[idx].value] : FALL;
+			}
+			uint8_t in = I->use | (out & ~I->kill) | (I->starts_block ? FALL : 0);
+			if (out != I->live_out || in != live_in[i]) {
+				I->live_out = out;
+				live_in[i] = in;
+				changed = true;
+			}
+		}
+	}
+
+	for (int i=0;i<n;i++) {
+		Insn *I = &insns[i];
+		uint8_t dead = FALL & ~I->live_out & ~I->reads;
+		if (!I->stub && dead) {
+			uint8_t use, kill, reads;
+			analyze_flags(I->body, dead, &use, &kill, &reads);
+		}
+	}
+
+	hmfree(index);
+	free(live_in);
+}
+
+// Base cycles of an opcode on the 68000. Like m68ki_build_opcode_table(),
+// account the shift distance of shifts with an immediate count, that is
+// not part of the handler table.
+static int opcode_cycles(const opcode_handler_struct *oph, uint16_t op) {
+	int cycles = oph->cycles[0];
+	if (oph->mask == 0xf1f8 && (op & 0xf000) == 0xe000 && !(op & 0x20))
+		cycles += ((((op >> 9) - 1) & 7) + 1) << 1;
+	return cycles;
+}
+
+// Memory regions that can be statically proven for the accesses of an opcode.
+// Keep in sync with HLE_MEM_* in m68k_recompiler.h.
+static const char *mem_region_names[] = {
+	"HLE_MEM_ANY", "HLE_MEM_WRAM", "HLE_MEM_PROM", "HLE_MEM_BIOS", "HLE_MEM_VRAM_DATA",
+};
+enum { MEM_ANY, MEM_WRAM, MEM_PROM, MEM_BIOS, MEM_VRAM_DATA };
+
+// Classify an access of span bytes at a statically known address.
+static int mem_region(bool known, uint32_t addr, int span, bool write, int size) {
+	uint32_t a = addr & 0xFFFFFF, b = (addr + span - 1) & 0xFFFFFF;
+	if (!known) return MEM_ANY;
+	if ((a >> 20) != (b >> 20)) return MEM_ANY;
+	switch (a >> 20) {
+	case 0x1: return MEM_WRAM;
+	case 0x0: return write ? MEM_ANY : MEM_PROM;
+	case 0xC: return write ? MEM_ANY : MEM_BIOS;
+	case 0x3: return write && a == 0x3C0002 && size == 16 && span == 2 ? MEM_VRAM_DATA : MEM_ANY;
+	}
+	return MEM_ANY;
+}
+
+// Find the memory regions accessed by an opcode, for reads (*rr) and writes
+// (*rw). The effective address macros are scanned in the handler body in
+// order, to follow the consumption of extension words, so that absolute
+// and PC-relative addresses can be computed.
+// Returns true if all the accesses were proven to fall in a specific region.
+static bool mem_regions(uint32_t pc, const uint8_t *func, int oplen, const char *handler,
+	const char *body, int *rr, int *rw)
+{
+	*rr = *rw = MEM_ANY;
+	bool move = strstartwith(handler, "m68k_op_move_");
+	int size = strstr(handler, "_32_") ? 32 : strstr(handler, "_16_") ? 16 : 8;
+	int span = strstartwith(handler, "m68k_op_movem_") ? 64 : size/8;
+	uint32_t addrs[2]; bool known[2]; int nea = 0;
+	int words = 0;
+
+	for (const char *p = body; (p = strpbrk(p, "EO")); p++) {
+		if (p > body && (isalnum(p[-1]) || p[-1] == '_')) continue;
+		const char *mode;
+		if (strstartwith(p, "OPER_I_")) {
+			words += strstartwith(p+7, "32") ? 2 : 1;
+			continue;
+		}
+		if (strstartwith(p, "EA_")) mode = p+3;
+		else if (strstartwith(p, "OPER_")) mode = p+5;
+		else continue;
+		if (!strstartwith(mode, "AY_") && !strstartwith(mode, "AX_") && !strstartwith(mode, "A7_") &&
+			!strstartwith(mode, "AW_") && !strstartwith(mode, "AL_") && !strstartwith(mode, "PC"))
+			continue;
+
+		if (nea == 2) return false;
+		uint32_t ext = pc + 2 + words*2;
+		uint32_t addr = 0;
+		known[nea] = true;
+		if (strstartwith(mode, "AW_")) {
+			addr = (int16_t)be16(func + 2 + words*2); words += 1;
+		} else if (strstartwith(mode, "AL_")) {
+			addr = (be16(func + 2 + words*2) << 16) | be16(func + 4 + words*2); words += 2;
+		} else if (strstartwith(mode, "PCDI_")) {
+			addr = ext + (int16_t)be16(func + 2 + words*2); words += 1;
+		} else {
+			known[nea] = false;
+			if (strstr(mode, "_DI_") == mode+2 || strstr(mode, "_IX_") == mode+2 || strstartwith(mode, "PCIX_"))
+				words += 1;
+		}
+		addrs[nea++] = addr;
+	}
+
+	// Extension words not matched to the opcode length: something was
+	// misparsed, do not trust the result.
+	if (words*2 != oplen-2) return false;
+	if (nea == 0) return false;
+	if (nea == 2 && !move) return false;
+	// Reads come from the first effective address (the source of a move),
+	// writes go to the last one.
+	bool reads = strstr(body, "m68ki_read_") || strstr(body, "OPER_A") || strstr(body, "OPER_PC");
+	bool writes = strstr(body, "m68ki_write_");
+	if (reads)  *rr = mem_region(known[0], addrs[0], span, false, size);
+	if (writes) *rw = mem_region(known[nea-1], addrs[nea-1], span, true, size);
+	return (!reads || *rr != MEM_ANY) && (!writes || *rw != MEM_ANY);
+}
+
+// Recompile the function starting at initial_pc into out.
+//
+// The function is decoded linearly, following branches within it. Decoding
+// stops at an unconditional jump (rts, bra, jmp, ...) if there is no pending
+// forward branch; otherwise, it restarts from the nearest branch target. Any
+// code that cannot be recompiled (illegal or unsupported opcodes, branch targets
+// that were not decoded, computed jumps) exits to the interpreter.
+//
+// Secondary entrypoints (instructions where the interpreter can resume
+// execution of the function) are returned in entrypoints. Statically known
+// targets of calls and jumps are returned in callees.
+//
+// Returns false if the function cannot be recompiled at all.
+bool gen_function(FILE *out, uint32_t initial_pc, uint32_t **entrypoints, uint32_t **callees) {
+	// Decoded instructions
+	Insn *insns = NULL;
+	// Instructions decoded so far (true) or left to the interpreter (false)
+	struct { uint32_t key; bool value; } *labels = NULL;
+	// Branch targets referenced in the code, that must have a label
+	struct { uint32_t key; bool value; } *targets = NULL;
+	// Forward branch targets not yet reached
+	struct { uint32_t key; bool value; } *forward_jumps = NULL;
+	// Candidate secondary entrypoints
+	uint32_t *reentries = NULL;
+	// Instructions that start a basic block (besides the ones following
+	// the end of a block)
+	struct { uint32_t key; bool value; } *block_starts = NULL;
+
+	unsigned int pc = initial_pc;
+	int opcount = 0;
+	while (1) {
+		char disasm[256]; char body[16384];
+		bool terminator = false;
+		int oplen = 0;
+
+		// If there was a forward jump to here, remove it from the list as it's satisfied now.
+		if (hmgeti(forward_jumps, pc) >= 0)
+			hmdel(forward_jumps, pc);
+
+		RomImage *img = find_image(pc);
+		const uint8_t *func = img ? img->data + pc - img->base : NULL;
+		const opcode_handler_struct *oph = NULL;
+		if (img && pc + 10 <= img->base + img->size && !(pc & 1)) {
+			oplen = m68k_disassemble_raw(disasm, pc, func, NULL, M68K_CPU_TYPE_68000);
+			if (!strstr(disasm, "ILLEGAL"))
+				oph = decode_opcode(be16(func));
+			if (oph && oph->cycles[0] == 0)
+				oph = NULL;
+		}
+		if (oph) strcpy(body, shget(op_interpreter, oph->opcode_handler));
+
+		Insn insn = { .pc = pc };
+		char *text; size_t textsz;
+		FILE *tout = open_memstream(&text, &textsz);
+
+		if (!oph || stranysubstr(body, unsupported_helpers)) {
+			// Cannot recompile this opcode: exit to the interpreter, that will
+			// execute it. We can resume at the next instruction, unless this is
+			// the end of the function (or we are not able to decode).
+			fprintf(tout, "\top_%08X: { // %s\n", pc, oph ? disasm : "<not decoded>");
+			fclose(tout);
+			insn.label = text;
+			insn.operands = strdup("");
+			insn.body = strdup("");
+			insn.tail = "\t\tgoto exit;\n\t}\n";
+			insn.exits = insn.stub = insn.needs_pc = insn.ends_block = true;
+			arrput(insns, insn);
+
+			hmput(labels, pc, false);
+			if (!oph || strstartwith(oph->opcode_handler, "m68k_op_rte_"))
+				terminator = true;
+			else
+				arrput(reentries, pc+oplen);
+			goto next;
+		}
+		hmput(labels, pc, true);
+
+		uint16_t op = be16(func);
+		fprintf(tout, "\top_%08X: { // %s\n", pc, disasm);
+		fclose(tout);
+		insn.label = text;
+
+		tout = open_memstream(&text, &textsz);
+		fprintf(tout, "\t\t// %s\n", oph->opcode_handler);
+		fprintf(tout, "\t\tuint REG_IR = 0x%x;\n", op);
+		int rr, rw;
+		bool mem_proven = mem_regions(pc, func, oplen, oph->opcode_handler, body, &rr, &rw);
+		if (rr != MEM_ANY || rw != MEM_ANY)
+			fprintf(tout, "\t\tenum { HLE_MEM_R = %s, HLE_MEM_W = %s };\n", mem_region_names[rr], mem_region_names[rw]);
+		if (oplen > 2) {		
+			if (oplen & 1) panic("invalid odd opcode length: %d @ PC:%x", oplen, pc);
+			fprintf(tout, "\t\tuint OPARG[] = { ");
+			for (int i=2;i<oplen;i+=2) fprintf(tout, "0x%04x%s", be16(&func[i]), i==oplen-2 ? " " : ", ");
+			fprintf(tout, "}; uint OPARGIDX=0;\n");
+		}
+		fclose(tout);
+		insn.operands = text;
+		insn.next_pc = pc+oplen;
+		insn.cycles = opcode_cycles(oph, op);
+
+		static const char *jump_tables[] = { "m68k_op_jmp_32_pc", NULL };
+		static const char *calls[] = { "m68k_op_bsr_", "m68k_op_jsr_", NULL };
+		static const char *jumps[] = { "m68k_op_bra_", "m68k_op_jmp_", "m68k_op_rts_", "m68k_op_rtr_", NULL };
+
+		char goto_next[128], goto_target[128];
+		sprintf(goto_next, "goto op_%08X;", pc+oplen);
+		terminator = stranyprefix(oph->opcode_handler, jumps);
+
+		int bsize = branch_size(oph->opcode_handler);
+		if (bsize && strcmp(oph->opcode_handler, "m68k_op_dbt_16")) {
+			bool is_bra = strstartwith(oph->opcode_handler, "m68k_op_bra_");
+			bool is_dbcc = strstartwith(oph->opcode_handler, "m68k_op_db");
+			unsigned int target = bsize == 8 ? pc + 2 + (int8_t)op : pc + 2 + (int16_t)be16(func+2);
+
+			sprintf(goto_target, "goto op_%08X;", target);
+			if (target > pc)
+				hmput(forward_jumps, target, true);
+			hmput(targets, target, true);
+			hmput(block_starts, target, true);
+			arrput(insn.succs, target);
+			insn.ends_block = true;
+
+			if (bsize == 16) {
+				if (is_bra) {
+					replace_word(body, "m68ki_branch_16(offset);", goto_target, 1);
+				} else {
+					replace_word(body, "m68ki_branch_16(offset);", "", 1);
+					replace_word(body, "return;", goto_target, 1);
+					// DBcc with a condition has another return path when the
+					// condition is true.
+					if (is_dbcc) {
+						replace_word(body, "return;", goto_next, -1);
+						hmput(targets, pc+oplen, true);
+					}
+				}
+			} else {
+				replace_word(body, "m68ki_branch_8(MASK_OUT_ABOVE_8(REG_IR));", goto_target, 1);
+				if (!is_bra)
+					replace_word(body, "return;", "", 1);
+			}
+		} else if (stranyprefix(oph->opcode_handler, jump_tables) && strstr(disasm, "($2,PC")) {
+			// A pc-relative jump is a duffdevice. See if we can handle it
+			int ddlen, ddstep; char jumptable[10240] = {0};
+			if (decode_duffdevice(img, pc+oplen, &ddlen, &ddstep) && ddlen < 200) {
+				strcat(jumptable, "\t\tswitch (REG_PC) { // duff device\n");
+				// Generate switch/case for handled targets in duff device.
+				// Notice that we also generate entry n+1 because that's potentially
+				// a valid target as well: it's the first instruction that has a different
+				// layout but it could be used by the programmers as target for skipping
+				// the whole sequence.
+				for (int i=0;i<=ddlen;i++) {
+					unsigned int tpc = pc + oplen + i*ddstep;
+
+					char label[64];
+					sprintf(label, "\t\t\tcase 0x%08x: goto op_%08X;\n", tpc, tpc);
+					strcat(jumptable, label);
+
+					// remember that this is a forward jump, we should see
+					// this address later on as part of the current function.
+					hmput(forward_jumps, tpc, true);
+					hmput(targets, tpc, true);
+					hmput(block_starts, tpc, true);
+					arrput(insn.succs, tpc);
+				}
+				strcat(jumptable, "\t\t};\n");
+				strcat(body, jumptable);
+			} else {
+				// Any other target will exit to the interpreter below.
+				fprintf(stderr, "warning: cannot decode duffdevice at %x, instruction: %s\n", pc+2, disasm);
+			}
+		} else {
+			// Any other handler might contain early returns, which just mean
+			// that the opcode is finished.
+			if (strstr(body, "return;")) {
+				replace_word(body, "return;", goto_next, -1);
+				hmput(targets, pc+oplen, true);
+				arrput(insn.succs, pc+oplen);
+			}
+		}
+		if (!terminator)
+			arrput(insn.succs, pc+oplen);
+
+		// If the function contains a jump or it's a subroutine call, it's
+		// probably a jump somewhere outside the current function, so the
+		// best course of action is exit the HLE function and fallback to
+		// the standard interpreter (which will in turn call the recompiled
+		// target, if any).
+		// For specific cases like direct branches or duff devices, the code
+		// above as already tried to decode the target inline to speed it up,
+		// but we keep this as a final fallback in case anything fails.
+		insn.tail = "\t}\n";
+		insn.io = !mem_proven && stranysubstr(body, mem_accessors);
+		insn.needs_pc = stranysubstr(body, pc_readers) || insn.io;
+		if (terminator) insn.ends_block = true;
+		// Opcodes with a variable number of cycles (shifts, movem) account
+		// them at runtime. The timeslice check at the start of a block only
+		// knows the base cycles, so they must be the last of their block.
+		if (strstr(body, "USE_CYCLES")) insn.ends_block = true;
+		if (stranyprefix(oph->opcode_handler, calls)) {
+			insn.tail = "\t\tgoto exit;\n\t}\n";
+			insn.exits = insn.ends_block = true;
+			// The opcode after the subroutine call is a possible re-entrypoint
+			// of the function.
+			arrput(reentries, pc+oplen);
+			uint32_t target = call_target(pc, func);
+			if (target) arrput(*callees, target);
+
+		} else if (strstr(body, "m68ki_jump")) {
+			insn.tail = "\t\tgoto exit;\n\t}\n";
+			insn.exits = insn.ends_block = true;
+			uint32_t target = call_target(pc, func);
+			if (target) arrput(*callees, target);
+
+		// If the opcode body still contains a branch, it's a bug because we
+		// need to handle all branches one way or another as goto.
+		} else if (strstr(body, "m68ki_branch_")) {
+			panic("unhandled branch in body at %x -- recompiler bug\n", pc);
+		}
+
+		// If the opcode body still contains a "return", it's a bug because we
+		// need to handle it before to convert it to an appropriate goto.
+		if (strstr(body, "return;")) {
+			panic("unhandled return in body at %x -- recompiler bug\n", pc);
+		}
+
+		insn.body = strdup(body);
+		arrput(insns, insn);
+
+	next:
+		pc += oplen;
+		if (++opcount > 10000) panic("function too long -- missing end of function");
+
+		// After an unconditional jump, the next instruction is reachable only
+		// if it is the target of a forward jump. Skip to the nearest target
+		// (if any), as there might be data in between.
+		if (terminator) {
+			bool found = false; unsigned int nextpc = 0;
+			for (int i=0;i<hmlen(forward_jumps);i++) {
+				if (forward_jumps[i].key >= pc && (!found || forward_jumps[i].key < nextpc)) {
+					nextpc = forward_jumps[i].key;
+					found = true;
+				}
+			}
+			if (!found) break;
+			pc = nextpc;
+		}
+	}
+
+	for (int i=0;i<arrlen(insns);i++) {
+		Insn *I = &insns[i];
+		I->starts_block = !I->stub && (i == 0 || insns[i-1].ends_block || hmgeti(block_starts, I->pc) >= 0);
+	}
+
+	strip_dead_flags(insns, arrlen(insns));
+
+	fprintf(out, "#include \"m68k_recompiler.h\"\n");
+	fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-label\"\n");
+	fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-variable\"\n");
+	fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-but-set-variable\"\n");
+	fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-value\"\n");
+	fprintf(out, "\n");
+	fprintf(out, "uint32_t func_%08X(m68ki_cpu_core * restrict __m68ki_cpu, int * restrict __m68ki_remaining_cycles, uint32_t __entry_pc) {\n", initial_pc);
+	fprintf(out, "\tif (__builtin_expect(__entry_pc != 0x%x, 0)) goto find_entrypoint;\n\n", initial_pc);
+	// Emit the instructions. The timeslice is checked at the start of each
+	// basic block: if it would end before the last opcode of the block, exit
+	// to the interpreter, which runs the block and stops exactly where the
+	// interpreter alone would have. The block is resumed later through its
+	// entrypoint. Cycles are accounted in bulk, but before any opcode that
+	// might access the hardware, so that it observes the same clock. The
+	// access might also end the timeslice (eg: by changing an event), so
+	// exit right after it in that case, like the interpreter does.
+	int pending = 0;
+	for (int i=0;i<arrlen(insns);i++) {
+		Insn *I = &insns[i];
+		bool last = i+1 == arrlen(insns) || insns[i+1].stub || insns[i+1].starts_block;
+		fprintf(out, "%s", I->label);
+		if (I->stub) {
+			fprintf(out, "\t\tREG_PC = 0x%x;\n", I->pc);
+			fprintf(out, "%s%s%s", I->operands, I->body, I->tail);
+			continue;
+		}
+		if (I->starts_block) {
+			int head = 0, n = 1;
+			for (int j=i;j+1<arrlen(insns) && !insns[j+1].stub && !insns[j+1].starts_block;j++) {
+				head += insns[j].cycles; n++;
+			}
+			fprintf(out, "\t\tif (GET_CYCLES() <= %d) { REG_PC = 0x%x; goto exit; } // block: %d opcodes\n", head, I->pc, n);
+			arrput(reentries, I->pc);
+			pending = 0;
+		}
+		if (I->io && pending) {
+			fprintf(out, "\t\tUSE_CYCLES(%d);\n", pending);
+			pending = 0;
+		}
+		pending += I->cycles;
+		if (last && !I->io) {
+			fprintf(out, "\t\tUSE_CYCLES(%d);\n", pending);
+			pending = 0;
+		}
+		if (I->needs_pc)
+			fprintf(out, "\t\tREG_PC = 0x%x;\n", I->pc+2);
+		if (last && I->io) {
+			// Account the cycles of the opcode after it, on all the paths
+			// that leave it.
+			char *body = malloc(strlen(I->body)*4 + 1024);
+			char from[64], to[64];
+			strcpy(body, I->body);
+			sprintf(from, "goto op_%08X;", I->next_pc);
+			sprintf(to, "goto op_%08X_end;", I->pc);
+			replace_word(body, from, to, -1);
+			sprintf(to, "{ USE_CYCLES(%d); goto exit; }", pending);
+			replace_word(body, "goto exit;", to, -1);
+			fprintf(out, "%s%s", I->operands, body);
+			fprintf(out, "\t\top_%08X_end: USE_CYCLES(%d);\n%s", I->pc, pending, I->tail);
+			pending = 0;
+			free(body);
+			continue;
+		}
+		fprintf(out, "%s%s", I->operands, I->body);
+		// The check at the start of the block guarantees that there are
+		// cycles left for this opcode, unless the timeslice was ended.
+		if (I->io)
+			fprintf(out, "\t\tif (GET_CYCLES() <= 0) { USE_CYCLES(%d); REG_PC = 0x%x; goto exit; }\n", pending, I->next_pc);
+		fprintf(out, "%s", I->tail);
+	}
+
+	fprintf(out, "\n\texit:\n");
+	fprintf(out, "\treturn REG_PC;\n");
+
+	// Branch targets that were not decoded (eg: in the middle of an instruction,
+	// or before the start of the function) exit to the interpreter.
+	for (int i=0;i<hmlen(targets);i++) {
+		uint32_t tpc = targets[i].key;
+		if (hmgeti(labels, tpc) < 0) {
+			fprintf(out, "\n\top_%08X:\n", tpc);
+			fprintf(out, "\tREG_PC = 0x%x;\n", tpc);
+			fprintf(out, "\tgoto exit;\n");
+		}
+	}
+
+	// Register as entrypoints only the instructions that were actually
+	// recompiled; resuming on an exit stub would never make progress.
+	fprintf(out, "\n\tfind_entrypoint:\n");
+	fprintf(out, "\tswitch (__entry_pc) {\n");
+	struct { uint32_t key; bool value; } *seen = NULL;
+	for (int i=0;i<arrlen(reentries);i++) {
+		uint32_t epc = reentries[i];
+		if (epc == initial_pc || hmgeti(seen, epc) >= 0) continue;
+		int idx = hmgeti(labels, epc);
+		if (idx < 0 || !labels[idx].value) continue;
+		hmput(seen, epc, true);
+		arrput(*entrypoints, epc);
+		fprintf(out, "\t\tcase 0x%x: goto op_%08X;\n", epc, epc);
+	}
+	fprintf(out, "\t}\n");
+	fprintf(out, "\tassert(!\"recompiler bug: invalid entrypoint\");\n");
+	fprintf(out, "\treturn __entry_pc;\n");
+	fprintf(out, "}\n");
+
+	int idx = hmgeti(labels, initial_pc);
+	bool ok = idx >= 0 && labels[idx].value;
+
+	for (int i=0;i<arrlen(insns);i++) {
+		free(insns[i].label);
+		free(insns[i].operands);
+		free(insns[i].body);
+		arrfree(insns[i].succs);
+	}
+	arrfree(insns);
+	hmfree(seen);
+	hmfree(labels);
+	hmfree(targets);
+	hmfree(forward_jumps);
+	hmfree(block_starts);
+	arrfree(reentries);
+	return ok;
+}
+
+// Add the entrypoints of a ROM image to the list of functions to recompile:
+// the exception vectors, and the Neo Geo specific entrypoints (the cartridge
+// header in the P-ROM, and the jump table of the system calls in the BIOS).
+void add_image_entrypoints(RomImage *img, uint32_t **roots) {
+	if (img->size < 0x500) return;
+
+	// Skip vector 0, which is the initial stack pointer.
+	for (int i=1;i<64;i++)
+		arrput(*roots, be32(img->data + i*4) & 0xFFFFFF);
+
+	if (img->base == 0 && !memcmp(img->data + 0x100, "NEO-GEO", 7)) {
+		for (uint32_t addr = 0x122; addr <= 0x134; addr += 6)
+			arrput(*roots, addr);
+	}
+
+	if (img->base == 0xC00000) {
+		for (uint32_t addr = 0x402; be16(img->data + addr) == 0x4EF9; addr += 6)
+			arrput(*roots, img->base + addr);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	if (argc < 3) {
-		printf("Usage: genhle <prom>[@<addr>] <func-addr> [<func-addr>...] [<prom>[<@addr>] <func-addr>...] \n");
+		printf("Usage: genhle [--all] <prom>[@<addr>] [<func-addr>...] [<prom>[<@addr>] <func-addr>...] \n");
 		printf("\n");
 		printf("Where:\n");
 		printf("   * <prom> is the path to a MVS64 P-ROM or BIOS (that has been previously byteswapped)\n");
 		printf("   * @<addr> is the optional loading address of the ROM (default: 0)\n");
 		printf("   * <func-addr> are the addresses of functions to HLE\n");
-		printf("\nExample:\n");
+		printf("   * --all recompiles all the code reachable from the ROM entrypoints (vectors,\n");
+		printf("     cartridge header, BIOS calls) and from the specified functions\n");
+		printf("\nExamples:\n");
 		printf("   genhle 201-p1.n64.bin 51f94 133e6 133b0 uni-bios.n64.bin@c00000 c1df9a\n");
+		printf("   genhle --all 201-p1.n64.bin uni-bios.n64.bin@c00000\n");
 		return 1;
 	}
 
-	struct { char *key; char *value; } *op_interpreter;
 	sh_new_strdup(op_interpreter);
 
 	FILE* f = fopen("m68kops.c", "r"); if (!f) panic("Cannot open: m68kops.c");
@@ -256,28 +996,29 @@ int main(int argc, char *argv[]) {
 	}
 	fclose(f);
 
-	uint8_t *PROM = NULL; unsigned int PROM_BASE = 0;
-
-	// Hashtable that maps a PC entrypoint to recompiled function start. Normally,
-	// a function has a single entrypoint (at its beginning) so most entries
-	// will have key==value, but for functions with multiple entrypoints (those
-	// that contains subroutine calls, where we can resume execution), there
-	// will be more entries pointing to the same function.
-	struct { uint32_t key; uint32_t value; } *func_pcs = NULL;
-
+	// Load all the ROMs first, so that calls across them can be followed.
+	bool whole_program = false;
+	uint32_t *roots = NULL;
 	for (int fx=1;fx<argc;fx++) {
+		if (!strcmp(argv[fx], "--all")) {
+			whole_program = true;
+			continue;
+		}
 		if (strchr(argv[fx], '.')) {
 			char fn[1024]; strcpy(fn, argv[fx]);
+			RomImage img = {0};
 			char *at = strrchr(fn, '@');
 			if (at) {
 				*at = 0;
-				PROM_BASE = strtoul(at+1, NULL, 16);
-			} else {
-				PROM_BASE = 0;
+				img.base = strtoul(at+1, NULL, 16);
 			}
-			if (PROM) free(PROM);
-			printf("Loading %s (base: %x)...\n", fn, PROM_BASE);
-			PROM = load_rom(fn);
+			printf("Loading %s (base: %x)...\n", fn, img.base);
+			size_t size;
+			img.data = load_rom(fn, &size);
+			// Only the first 1 MiB is linearly mapped (the rest of a P-ROM
+			// is banked).
+			img.size = size < 0x100000 ? size : 0x100000;
+			arrput(images, img);
 			continue;
 		}
 
@@ -286,187 +1027,75 @@ int main(int argc, char *argv[]) {
 			printf("Invalid argument: %s (ignoring)\n", argv[fx]);
 			continue;
 		}
-		unsigned int pc = initial_pc;
-
-		char outfn[32] = "hle_"; strcat(outfn, argv[fx]); strcat(outfn, ".c");
-		FILE *out = fopen(outfn, "w"); if (!out) panic("Cannot create: %s\n", outfn);
+		arrput(roots, initial_pc);
+	}
 
-		printf("Generating %s...\n", outfn);
-
-		const uint8_t *func = PROM + pc - PROM_BASE;
-		struct { unsigned int key; bool value; } *forward_jumps = NULL;
-
-		// List of entrypoints within this function (besides the initial one)
-		uint32_t *entrypoints = NULL;
-
-		// Record the initial entrypoint at the start of the function in the
-		// global map.
-		hmput(func_pcs, pc, pc);
-
-		fprintf(out, "#include \"m68k_recompiler.h\"\n");
-		fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-label\"\n");
-		fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-variable\"\n");
-		fprintf(out, "\n");
-		fprintf(out, "uint32_t func_%08X(m68ki_cpu_core * restrict __m68ki_cpu, int * restrict __m68ki_remaining_cycles, uint32_t __entry_pc) {\n", pc);
-		fprintf(out, "\tif (__builtin_expect(__entry_pc != 0x%x, 0)) goto find_entrypoint;\n\n", pc);
-
-		int opcount = 0;
-		while (1) {
-			char disasm[256]; char body[16384];
-			int oplen = m68k_disassemble_raw(disasm, pc, func, NULL, M68K_CPU_TYPE_68000);
-
-			if (strstr(disasm, "ILLEGAL")) panic("fatal: illegal instruction at %x\n", pc);
-
-			// If there was a forward jump to here, remove it from the list as it's satisfied now.
-			if (hmgeti(forward_jumps, pc) >= 0)
-				hmdel(forward_jumps, pc);
-
-			uint16_t op = be16(func);
-			const opcode_handler_struct *oph = decode_opcode(op);
-			strcpy(body, shget(op_interpreter, oph->opcode_handler));
-
-			fprintf(out, "\top_%08X: { // %s\n", pc, disasm);
-			fprintf(out, "\t\t// %s\n", oph->opcode_handler);
-			fprintf(out, "\t\tREG_PC = 0x%x;\n", pc+2);
-			fprintf(out, "\t\tUSE_CYCLES(%d);\n", oph->cycles[0]);
-			fprintf(out, "\t\tuint REG_IR = 0x%x;\n", be16(func));
-			if (oplen > 2) {		
-				if (oplen & 1) panic("invalid odd opcode length: %d @ PC:%x", oplen, pc);
-				fprintf(out, "\t\tuint OPARG[] = { ");
-				for (int i=2;i<oplen;i+=2) fprintf(out, "0x%04x%s", be16(&func[i]), i==oplen-2 ? " " : ", ");
-				fprintf(out, "}; uint OPARGIDX=0;\n");
-			}
+	if (whole_program)
+		for (int i=0;i<arrlen(images);i++)
+			add_image_entrypoints(&images[i], &roots);
 
-			static const char *fake_return[] = { "m68k_op_lsl_", "m68k_op_lsr_", "m68k_op_sne_", NULL };
-			static const char *branches_off_8[] =  { "m68k_op_beq_8",  "m68k_op_bne_8",  "m68k_op_blt_8",  "m68k_op_bgt_8",  "m68k_op_bcc_8",  "m68k_op_dbf_8",  "m68k_op_bra_8",  NULL };
-			static const char *branches_off_16[] = { "m68k_op_beq_16", "m68k_op_bne_16", "m68k_op_blt_16", "m68k_op_bgt_16", "m68k_op_bcc_16", "m68k_op_dbf_16", "m68k_op_bra_16", NULL };
-			static const char *jump_tables[] = { "m68k_op_jmp_32_pc", NULL };
-			static const char *calls[] = { "m68k_op_bsr_", "m68k_op_jsr_", NULL };
-
-			bool is_backward_branch = false;
-			char goto_next[24]; unsigned int target=0;
-			if (stranyprefix(oph->opcode_handler, branches_off_16)) {
-				target = pc + 2 + (int16_t)be16(func+2);
-				is_backward_branch = target < pc;
-				sprintf(goto_next, "goto op_%08X;", target);
-				if (!strstartwith(oph->opcode_handler, "m68k_op_bra_")) {
-					replace_word(body, "m68ki_branch_16(offset);", "", 1);
-					replace_word(body, "return;", goto_next, 1);
-				} else {
-					replace_word(body, "m68ki_branch_16(offset);", goto_next, 1);					
-				}
-			} else if (stranyprefix(oph->opcode_handler, branches_off_8)) {
-				target = pc + 2 + (int8_t)op;
-				is_backward_branch = target < pc;
-				sprintf(goto_next, "goto op_%08X;", target);
-				replace_word(body, "m68ki_branch_8(MASK_OUT_ABOVE_8(REG_IR));", goto_next, 1);
-				if (!strstartwith(oph->opcode_handler, "m68k_op_bra_"))
-					replace_word(body, "return;", "", 1);
-			} else if (stranyprefix(oph->opcode_handler, fake_return)) {
-				target = pc + oplen;
-				sprintf(goto_next, "goto op_%08X;", target);
-				replace_word(body, "return;", goto_next, -1);
-			} else if (stranyprefix(oph->opcode_handler, jump_tables)) {
-				// A pc-relative jump is a duffdevice. See if we can handle it
-				if (strstr(disasm, "($2,PC")) {
-					int ddlen, ddstep; char jumptable[10240] = {0};
-					if (decode_duffdevice(PROM, pc+oplen, &ddlen, &ddstep)) {
-						strcat(jumptable, "\t\tswitch (REG_PC) { // duff device\n");
-						// Generate switch/case for handled targets in duff device.
-						// Notice that we also generate entry n+1 because that's potentially
-						// a valid target as well: it's the first instruction that has a different
-						// layout but it could be used by the programmers as target for skipping
-						// the whole sequence.
-						for (int i=0;i<ddlen;i++) {
-							unsigned int tpc = pc + oplen + i*ddstep;
-
-							char label[64];
-							sprintf(label, "\t\t\tcase 0x%08x: goto op_%08X;\n", tpc, tpc);
-							strcat(jumptable, label);
-
-							// remember that this is a forward jump, we should see
-							// this address later on as part of the current function.
-							hmput(forward_jumps, tpc, true);
-						}
-						strcat(jumptable, "\t\t};\n");
-						strcat(body, jumptable);
-
-						hmput(forward_jumps, pc + oplen + ddlen*ddstep, true);
-					} else {
-						panic("cannot decode duffdevice at %x, instruction: %s", pc+2, disasm);
-					}
-				} else
-					panic("unsupported jump table instruction: %s", disasm);
-			}
-			if (target > pc) hmput(forward_jumps, target, true);
-		
-			fprintf(out, "%s", body);
-
-			// If the function contains a jump or it's a subroutine call, it's
-			// probably a jump somewhere outside the current function, so the
-			// best course of action is exit the HLE function and fallback to
-			// the standard interpreter.
-			// For specific cases like direct branches or duff devices, the code
-			// above as already tried to decode the target inline to speed it up,
-			// but we keep this as a final fallback in case anything fails.
-			if (stranyprefix(oph->opcode_handler, calls)) {
-				fprintf(out, "\t\tgoto exit;\n");
-				// The opcode after the subroutine call is a possible re-entrypoint
-				// of the function.
-				arrput(entrypoints, pc+oplen);
-				hmput(func_pcs, pc+oplen, initial_pc);
-
-			} else if (strstr(body, "m68ki_jump")) {
-				fprintf(out, "\t\tgoto exit;\n");
-
-			// If the opcode body still contains a branch, it's a bug because we
-			// need to handle all branches one way or another as goto.
-			// FIXME: we might want to change this to treat all residual branches
-			// as jumps, and simply exit the HLE function.
-			} else if (strstr(body, "m68ki_branch_")) {
-				panic("unhandled branch in body -- recompiler bug\n");	
-			}
+	// Hashtable that maps a PC entrypoint to recompiled function start. Normally,
+	// a function has a single entrypoint (at its beginning) so most entries
+	// will have key==value, but for functions with multiple entrypoints (those
+	// that contains subroutine calls, where we can resume execution), there
+	// will be more entries pointing to the same function.
+	struct { uint32_t key; uint32_t value; } *func_pcs = NULL;
+	struct { uint32_t key; bool value; } *visited = NULL;
+	int nfuncs = 0;
+
+	// Process the list of functions. In whole program mode, the list grows
+	// with all the call targets found in the recompiled functions.
+	for (int fx=0;fx<arrlen(roots);fx++) {
+		unsigned int pc = roots[fx];
+		if (hmgeti(visited, pc) >= 0) continue;
+		hmput(visited, pc, true);
+
+		// Skip functions outside of the ROMs, and in the vector tables.
+		RomImage *img = find_image(pc);
+		if (!img || (pc & 1) || pc - img->base < 0x100) {
+			if (!whole_program) printf("Invalid function address: %x (ignoring)\n", pc);
+			continue;
+		}
 
-			// If the opcode body still contains a "return", it's a bug because we
-			// need to handle it before to convert it to an appropriate goto.
-			if (strstr(body, "return;")) {
-				panic("unhandled return in body -- recompiler bug\n");
-			}
+		char outfn[32]; sprintf(outfn, "hle_%x.c", pc);
+		FILE *out = fopen(outfn, "w"); if (!out) panic("Cannot create: %s\n", outfn);
 
-			fprintf(out, "\t}\n");
+		if (!whole_program) printf("Generating %s...\n", outfn);
 
-			pc += oplen;
-			func += oplen;
-			if (++opcount > 10000) panic("function too long -- missing end of function");
+		uint32_t *entrypoints = NULL, *callees = NULL;
+		bool ok = gen_function(out, pc, &entrypoints, &callees);
+		fclose(out);
 
-			// See if this is a possible exit point: search for an absolute jump
-			if (strstr(oph->opcode_handler, "m68k_op_rts_") || (strstr(oph->opcode_handler, "m68k_op_bra_") && is_backward_branch)) {
-				// Exit only if the next instruction was not the target of a forward jump.
-				// Otherwise, this is not a terminating instruction.
-				if (hmgeti(forward_jumps, pc) < 0) {
-					break;
-				}
-			}
+		if (!ok && arrlen(entrypoints) == 0) {
+			// Nothing could be recompiled
+			remove(outfn);
+		} else {
+			// The start of a function has precedence over a secondary
+			// entrypoint of another function. If the first instruction
+			// could not be recompiled, the function is still reachable
+			// through its other entrypoints.
+			if (ok) hmput(func_pcs, pc, pc);
+			for (int i=0;i<arrlen(entrypoints);i++)
+				if (hmgeti(func_pcs, entrypoints[i]) < 0)
+					hmput(func_pcs, entrypoints[i], pc);
+			nfuncs++;
 		}
 
-		fprintf(out, "\n\texit:\n");
-		fprintf(out, "\treturn REG_PC;\n");
-		fprintf(out, "\n\tfind_entrypoint:\n");
-		for (int i=0;i<arrlen(entrypoints);i++)
-			fprintf(out, "\tif (__entry_pc == 0x%x) goto op_%08X;\n", entrypoints[i], entrypoints[i]);
-		fprintf(out, "\tassert(!\"recompiler bug: invalid entrypoint\");\n");
-		fprintf(out, "}\n");
-		fclose(out);
+		if (whole_program)
+			for (int i=0;i<arrlen(callees);i++)
+				arrput(roots, callees[i]);
 
-		if (hmlen(forward_jumps) > 0) panic("forward jump not satisfied: %x", forward_jumps[0].key);
-		hmfree(forward_jumps);
 		arrfree(entrypoints);
+		arrfree(callees);
 	}
 
+	if (whole_program)
+		printf("Generated %d functions (%d entrypoints)\n", nfuncs, (int)hmlen(func_pcs));
+	if (hmlen(func_pcs) == 0) panic("no functions generated\n");
+
 	// Copy all keys of the global entrypoint map into an array.
 	uint32_t all_pcs[hmlen(func_pcs)];
 	for (int i=0;i<hmlen(func_pcs);i++) all_pcs[i] = func_pcs[i].key;
-
 	uint32_t ph_mul, ph_shift, ph_mask;
 	if (!find_perfect_hash(all_pcs, hmlen(func_pcs), &ph_mul, &ph_shift, &ph_mask)) panic("cannot find perfect hash for functions");
 
@@ -481,9 +1110,13 @@ int main(int argc, char *argv[]) {
 	printf("Generating hle_index.c...\n");
 
 	fprintf(out, "#include \"hle_index.h\"\n\n");
-	for (int i=0;i<hmlen(func_pcs);i++) 
-		if (func_pcs[i].key == func_pcs[i].value)
-			fprintf(out, "extern uint32_t func_%08X(m68ki_cpu_core *cpu, int *cycles, uint32_t pc);\n", func_pcs[i].value);
+	struct { uint32_t key; bool value; } *declared = NULL;
+	for (int i=0;i<hmlen(func_pcs);i++) {
+		if (hmgeti(declared, func_pcs[i].value) >= 0) continue;
+		hmput(declared, func_pcs[i].value, true);
+		fprintf(out, "extern uint32_t func_%08X(m68ki_cpu_core *cpu, int *cycles, uint32_t pc);\n", func_pcs[i].value);
+	}
+	hmfree(declared);
 
 	fprintf(out, "\nconst HLEFunc g_hle_funcs[%d] = {\n", ph_mask+1);
 	for (int i=0;i<ph_mask+1;i++) {
@@ -30,8 +30,11 @@ uint8_t WORK_RAM[64*1024] ALIGN_64K;
 uint8_t BACKUP_RAM[64*1024] ALIGN_64K;
 uint16_t PALETTE_RAM[8*1024];  // two banks
 uint16_t VIDEO_RAM[34*1024];
+uint8_t VIDEO_RAM_DIRTY[34*1024];
+uint8_t PALETTE_RAM_DIRTY[8*1024/16];
 
 int PALETTE_RAM_BANK;
+int FIX_ROM_BANK;
 
 typedef uint32_t (*ReadCB)(uint32_t addr, int sz);
 typedef void (*WriteCB)(uint32_t addr, uint32_t val, int sz);
@@ -45,6 +48,60 @@ typedef struct {
 
 static Bank banks[16];
 
+#ifndef N64
+// Fast memory map used by the CPU core (see m68kinline.h), with 4 KiB pages.
+// Pages of RAM and ROM point directly to host memory; the others are NULL,
+// and their accesses go through the handlers of the bank.
+uint8_t *hw_rpages[4096], *hw_wpages[4096];
+
+// Update the pages of the fast memory map covered by a bank
+static void map_bank(int idx) {
+	Bank *b = &banks[idx];
+	for (int i=0; i<256; i++) {
+		uint8_t *mem = b->mem ? b->mem + ((i << 12) & b->mask) : NULL;
+		hw_rpages[idx*256+i] = b->r ? NULL : mem;
+		hw_wpages[idx*256+i] = b->w ? NULL : mem;
+	}
+}
+#else
+// On N64, memory is mapped through the TLB (see hw_init)
+static void map_bank(int idx) {}
+#endif
+
+// Hardware registers (0x3xxxxx). Each device registers the handlers of its
+// registers with mmio_register(), and accesses are dispatched through a flat
+// table with a slot per byte address. Only the first 128 bytes of each
+// 64 KiB block are decoded, as registers are not mirrored.
+#define MMIO_SLOT(addr)    ((((addr) >> 9) & 0x780) | ((addr) & 0x7F))
+
+typedef struct {
+	ReadCB r;
+	WriteCB w;
+} MmioSlot;
+
+static MmioSlot mmio[16*128];
+
+static uint32_t mmio_read_unk(uint32_t addr, int sz) {
+	// debugf("[HWIO] unknown read%d: %06x\n", sz*8, (unsigned int)addr);
+	return 0xFFFFFFFF;
+}
+
+static void mmio_write_unk(uint32_t addr, uint32_t val, int sz) {
+	// debugf("[HWIO] unknown write%d: %06x <- %0*x (PC=%06lx)\n", sz*8, (unsigned int)addr, sz*2, (unsigned int)val, emu_pc());
+}
+
+// Register the handlers for the byte addresses [addr, addr+size). Either
+// handler can be NULL to leave that direction untouched. Word registers are
+// registered with size 2, so their handlers also get byte accesses to either
+// half of the word.
+static void mmio_register(uint32_t addr, uint32_t size, ReadCB r, WriteCB w) {
+	for (uint32_t a=addr; a<addr+size; a++) {
+		assertf((a & 0xF0FF80) == 0x300000, "invalid MMIO address: %06x", (unsigned int)a);
+		if (r) mmio[MMIO_SLOT(a)].r = r;
+		if (w) mmio[MMIO_SLOT(a)].w = w;
+	}
+}
+
 #include "rtc.c"
 #include "lspc.c"
 #include "input.c"
@@ -76,7 +133,11 @@ void write_pbrom(uint32_t addr, uint32_t val, int sz) {
 			m64k_map_memory(&m64k, 0x200000, 0x100000, banks[0x2].mem, false);
 			// m64k_map_memory_change(&m64k, pbrom_memid, banks[0x2].mem, false);
 			#endif
+			map_bank(0x2);
 		}
+		#ifndef N64
+		m68k_predecode_map(0x200000, 0x100000, val);
+		#endif
 		return;
 	}
 
@@ -94,142 +155,203 @@ uint32_t read_pbrom(uint32_t addr, int sz) {
 	// FIXME: see if we can detect when this is false, to avoid bugs
 	if (addr == 0x2fffef && sz == 1) return pbrom_bank >> 20;
 
+	if (sz == 1) addr = MEM_BYTE(addr);
 	uint8_t *rom = pbrom_cache_lookup(pbrom_bank | (addr & 0x0FFFFF));
-	if (sz == 4) return BE32(*(u_uint32_t*)rom);
-	if (sz == 2) return BE16(*(uint16_t*)rom);
+	if (sz == 4) return MEM32(*(u_uint32_t*)rom);
+	if (sz == 2) return MEM16(*(uint16_t*)rom);
 	return *rom;
 }
 
-uint32_t read_hwio(uint32_t addr, int sz)  {
-	if (sz == 4) {
-		// NOTE: order is important
-		uint32_t val = read_hwio(addr+0, 2) << 16;
-		return val | read_hwio(addr+2, 2);
-	}
-
-	// Idle skip for RTC Wait Pulse in BIOS boot
-	#if 0
-	if (addr == 0x320001 && emu_pc() == 0xC11DA2) {
-		m68k_consume_timeslice();
-	}
+// Called when the vector table at the start of P-ROM is swapped
+static void vectors_changed(void) {
+	#ifndef N64
+	m68k_predecode_invalidate(0x000000, sizeof(P_ROM_VECTOR));
 	#endif
+}
+
+static uint32_t sys_dipsw_r(uint32_t addr, int sz) {
+	assert(sz==1);
+	return 0xFF ^ DIPSW_FREEPLAY;
+}
+
+static uint32_t sys_z80_r(uint32_t addr, int sz) {
+	assert(sz==1);
+	debugf("[HWIO] Read Z80 command\n");
+	return 1;
+}
+
+static void sys_z80_w(uint32_t addr, uint32_t val, int sz) {
+	assert(sz==1);
+	debugf("[HWIO] Send Z80 command: %02x\n", (unsigned int)val);
+}
 
-	// debugf("[HWIO] read%d: %06x (68K PC:%x)\n", sz*8, (unsigned int)addr, m68k_get_reg(NULL, M68K_REG_PC));
-	// debugf("[HWIO] read%d: %06x (68K PC:%x EPC:%lx)\n", sz*8, (unsigned int)addr, m68k_get_reg(NULL, M68K_REG_PC), C0_READ_EPC());
+// System latches (0x3A00xx): writing any value to a latch address triggers it
+static void sys_bios_vectors_w(uint32_t addr, uint32_t val, int sz) {
+	assert(sz==1);
+	memcpy(P_ROM, BIOS, sizeof(P_ROM_VECTOR));
+	vectors_changed();
+}
 
-	if ((addr>>16) == 0x30) switch (addr&0xFFFF) {
-		case 0x00: assert(sz==1); return input_p1cnt_r();
-		case 0x01: assert(sz==1); return 0xFF ^ DIPSW_FREEPLAY; // dipswitches
+static void sys_game_vectors_w(uint32_t addr, uint32_t val, int sz) {
+	assert(sz==1);
+	memcpy(P_ROM, P_ROM_VECTOR, sizeof(P_ROM_VECTOR));
+	vectors_changed();
+}
 
-	} else if ((addr>>16) == 0x32) switch (addr&0xFFFF) {
-		case 0x00: assert(sz==1); debugf("[HWIO] Read Z80 command\n"); return 1;
-		case 0x01: assert(sz==1); return input_status_a_r();
+static void sys_sram_lock_w(uint32_t addr, uint32_t val, int sz) {
+	assert(sz==1);
+	banks[0xD].w = write_unk;
+	map_bank(0xD);
+}
 
-	} else if ((addr>>16) == 0x38) switch (addr&0xFFFF) {
-		case 0x00: assert(sz==1); return input_status_b_r();
+static void sys_sram_unlock_w(uint32_t addr, uint32_t val, int sz) {
+	assert(sz==1);
+	banks[0xD].w = NULL;
+	map_bank(0xD);
+}
 
-	} else if ((addr>>16) == 0x3A) switch (addr&0xFFFF) {
+// Switching S-ROM changes the tiles of all the fix layer cells
+static void sys_bios_fix_w(uint32_t addr, uint32_t val, int sz) { assert(sz==1); FIX_ROM_BANK = 0; memset(VIDEO_RAM_DIRTY+0x7000, 1, 0x500); }
+static void sys_game_fix_w(uint32_t addr, uint32_t val, int sz) { assert(sz==1); FIX_ROM_BANK = 1; memset(VIDEO_RAM_DIRTY+0x7000, 1, 0x500); }
+static void sys_palette_bank1_w(uint32_t addr, uint32_t val, int sz) { assert(sz==1); PALETTE_RAM_BANK = 0x1000; }
+static void sys_palette_bank0_w(uint32_t addr, uint32_t val, int sz) { assert(sz==1); PALETTE_RAM_BANK = 0x0000; }
+
+static void sys_init(void) {
+	mmio_register(0x300001, 1, sys_dipsw_r, NULL);
+	mmio_register(0x320000, 1, sys_z80_r, sys_z80_w);
+	mmio_register(0x3A0003, 1, NULL, sys_bios_vectors_w);
+	mmio_register(0x3A0013, 1, NULL, sys_game_vectors_w);
+	mmio_register(0x3A000D, 1, NULL, sys_sram_lock_w);
+	mmio_register(0x3A001D, 1, NULL, sys_sram_unlock_w);
+	mmio_register(0x3A000B, 1, NULL, sys_bios_fix_w);
+	mmio_register(0x3A001B, 1, NULL, sys_game_fix_w);
+	mmio_register(0x3A000F, 1, NULL, sys_palette_bank1_w);
+	mmio_register(0x3A001F, 1, NULL, sys_palette_bank0_w);
+}
 
-	} else if ((addr>>16) == 0x3C) switch (addr&0xFFFF) {
-		case 0x00: case 0x08: case 0x0A:
-		case 0x02: assert(sz==2); return lspc_vram_data_r();
-		case 0x0C:
-		case 0x04: assert(sz==2); return lspc_vram_modulo_r();
-		case 0x0E:
-		case 0x06: assert(sz==2); return lspc_mode_r();
-	}
+static inline uint32_t mmio_read(uint32_t addr, int sz) {
+	if (addr & 0xFF80) return mmio_read_unk(addr, sz);
+	return mmio[MMIO_SLOT(addr)].r(addr, sz);
+}
 
-	// debugf("[HWIO] unknown read%d: %06x\n", sz*8, (unsigned int)addr);
-	return 0xFFFFFFFF;
+static inline void mmio_write(uint32_t addr, uint32_t val, int sz) {
+	if (addr & 0xFF80) { mmio_write_unk(addr, val, sz); return; }
+	mmio[MMIO_SLOT(addr)].w(addr, val, sz);
 }
 
-void write_hwio(uint32_t addr, uint32_t val, int sz)  {
+uint32_t read_hwio(uint32_t addr, int sz)  {
+	// 32-bit accesses are split in two 16-bit accesses (high word first)
 	if (sz == 4) {
-		write_hwio(addr+0, val>>16, 2);
-		write_hwio(addr+2, val&0xFFFF, 2);
-		return;
+		uint32_t val = mmio_read(addr+0, 2) << 16;
+		return val | (mmio_read(addr+2, 2) & 0xFFFF);
 	}
+	return mmio_read(addr, sz);
+}
 
-	if ((addr>>16) == 0x30) switch (addr&0xFFFF) {
-		case 0x01: watchdog_kick(); return;
-
-	} else if ((addr>>16) == 0x32) switch (addr&0xFFFF) {
-		case 0x00: assert(sz==1); debugf("[HWIO] Send Z80 command: %02x\n", (unsigned int)val); return;
-
-	} else if ((addr>>16) == 0x38) switch (addr&0xFFFF) {
-		case 0x51: rtc_data_w(val&1); rtc_clock_w(val&2); rtc_stb_w(val&4); return;
-
-	} else if ((addr>>16) == 0x3A) switch (addr&0xFFFF) {
-		case 0x03: assert(sz==1); memcpy(P_ROM, BIOS, sizeof(P_ROM_VECTOR)); return;
-		case 0x13: assert(sz==1); memcpy(P_ROM, P_ROM_VECTOR, sizeof(P_ROM_VECTOR)); return;
-		case 0x0F: assert(sz==1); PALETTE_RAM_BANK = 0x1000; return;
-		case 0x1F: assert(sz==1); PALETTE_RAM_BANK = 0x0000; return;
-		case 0x0D: assert(sz==1); banks[0xD].w = write_unk; return;
-		case 0x1D: assert(sz==1); banks[0xD].w = NULL; return;
-		case 0x0B: assert(sz==1); srom_set_bank(0); return;
-		case 0x1B: assert(sz==1); srom_set_bank(1); return;
-
-	} else if ((addr>>16) == 0x3C) switch (addr&0xFFFF) {
-		case 0x00: assert(sz==2); lspc_vram_addr_w(val); return;
-		case 0x02: assert(sz==2); lspc_vram_data_w(val); return;
-		case 0x04: assert(sz==2); lspc_vram_modulo_w(val); return;
-		case 0x06: assert(sz==2); lspc_mode_w(val); return;
-		case 0x0C: if (val&1) emu_cpu_irq(3,false); if (val&2) emu_cpu_irq(2,false); if (val&4) emu_cpu_irq(1,false); return;
+void write_hwio(uint32_t addr, uint32_t val, int sz)  {
+	if (sz == 4) {
+		mmio_write(addr+0, val>>16, 2);
+		mmio_write(addr+2, val&0xFFFF, 2);
+		return;
 	}
-
-	// debugf("[HWIO] unknown write%d: %06x <- %0*x (PC=%06lx)\n", sz*8, (unsigned int)addr, sz*2, (unsigned int)val, emu_pc());
+	mmio_write(addr, val, sz);
 }
 
 
 #ifndef N64
 
-unsigned int  m68k_read_memory_8(unsigned int address) {
-	Bank *b = &banks[(address>>20)&0xF];
-	if (b->r) return b->r(address, 1);
-	if (b->mem) return *(b->mem + (address & b->mask));
-	debugf("[MEM] unknown read8: %06x\n", (unsigned int)address);
-	return 0xFF;
+// Call a bank I/O handler, accounting the time spent in profile_hw_io when
+// profiling is enabled (on N64, this is done by the TLB handler in hw_n64.S).
+extern uint32_t profile_hw_io;
+extern bool profile_enabled;
+
+static inline uint32_t hwio_read(Bank *b, uint32_t address, int sz) {
+	if (likely(!profile_enabled)) return b->r(address, sz);
+	profile_hw_io -= TICKS_READ();
+	uint32_t val = b->r(address, sz);
+	profile_hw_io += TICKS_READ();
+	return val;
 }
 
-unsigned int  m68k_read_memory_16(unsigned int address) {
-	assertf(!(address&1), "unaligned rm16: %x\n", address);
-	Bank *b = &banks[(address>>20)&0xF];
-	if (b->r) return b->r(address, 2);
-	if (b->mem) return BE16(*(u_uint16_t*)(b->mem + (address & b->mask)));
-	debugf("[MEM] unknown read16: %06x\n", (unsigned int)address);
-	return 0xFFFF;
+static inline void hwio_write(Bank *b, uint32_t address, uint32_t val, int sz) {
+	if (likely(!profile_enabled)) { b->w(address, val, sz); return; }
+	profile_hw_io -= TICKS_READ();
+	b->w(address, val, sz);
+	profile_hw_io += TICKS_READ();
 }
 
-unsigned int  m68k_read_memory_32(unsigned int address) {
-	assertf(!(address&1), "unaligned rm32: %x\n", address);
-	Bank *b = &banks[(address>>20)&0xF];
-	if (b->r) return b->r(address, 4);
-	if (b->mem) return BE32(*(u_uint32_t*)(b->mem + (address & b->mask)));
-	debugf("[MEM] unknown read32: %06x\n", (unsigned int)address);
-	return 0;
-}
+// Called on every memory write done by the CPU core that is not in the fast
+// memory map (see lockstep.c).
+void (*hw_write_hook)(uint32_t addr, uint32_t val, int sz);
+
+// Memory accesses of the CPU core that are not in the fast memory map
+unsigned int hw_mem_read(unsigned int address, int sz) {
+	// 32-bit accesses can straddle two pages
+	if (sz == 4 && (address & 0xFFF) == 0xFFE)
+		return (m68k_read_memory_16(address) << 16) | m68k_read_memory_16(address+2);
 
-void m68k_write_memory_8(unsigned int address, unsigned int value) {
+	assertf(sz == 1 || !(address&1), "unaligned rm%d: %x\n", sz*8, address);
 	Bank *b = &banks[(address>>20)&0xF];
-	if (b->w) { b->w(address, value, 1); return; }
-	if (b->mem) { *(b->mem + (address & b->mask)) = value; return; }
-	debugf("[MEM] unknown write8: %06x = %02x\n", (unsigned int)address, (unsigned int)value);
+	if (b->r) return hwio_read(b, address, sz);
+	if (b->mem) {
+		if (sz == 4) return MEM32(*(u_uint32_t*)(b->mem + (address & b->mask)));
+		if (sz == 2) return MEM16(*(u_uint16_t*)(b->mem + (address & b->mask)));
+		return b->mem[MEM_BYTE(address & b->mask)];
+	}
+	debugf("[MEM] unknown read%d: %06x\n", sz*8, (unsigned int)address);
+	return sz == 4 ? 0 : 0xFFFF >> (16 - sz*8);
 }
 
-void m68k_write_memory_16(unsigned int address, unsigned int value) {
-	assertf(!(address&1), "unaligned wm16: %x\n", address);
+void hw_mem_write(unsigned int address, unsigned int value, int sz) {
+	if (sz == 4 && (address & 0xFFF) == 0xFFE) {
+		m68k_write_memory_16(address, value >> 16);
+		m68k_write_memory_16(address+2, value & 0xFFFF);
+		return;
+	}
+
+	if (unlikely(hw_write_hook)) hw_write_hook(address, value, sz);
+	assertf(sz == 1 || !(address&1), "unaligned wm%d: %x\n", sz*8, address);
 	Bank *b = &banks[(address>>20)&0xF];
-	if (b->w) { b->w(address, value, 2); return; }
-	if (b->mem) { *(u_uint16_t*)(b->mem + (address & b->mask)) = BE16(value); return; }
-	debugf("[MEM] unknown write16: %06x = %04x\n", (unsigned int)address, (unsigned int)value);
+	if (b->w) { hwio_write(b, address, value, sz); return; }
+	if (b->mem) {
+		if (sz == 4) *(u_uint32_t*)(b->mem + (address & b->mask)) = MEM32(value);
+		else if (sz == 2) *(u_uint16_t*)(b->mem + (address & b->mask)) = MEM16(value);
+		else b->mem[MEM_BYTE(address & b->mask)] = value;
+		return;
+	}
+	debugf("[MEM] unknown write%d: %06x = %0*x\n", sz*8, (unsigned int)address, sz*2, (unsigned int)value);
 }
 
-void m68k_write_memory_32(unsigned int address, unsigned int value) {
-	assertf(!(address&1), "unaligned wm32: %x\n", address);
-	Bank *b = &banks[(address>>20)&0xF];
-	if (b->w) { b->w(address, value, 4); return; }
-	if (b->mem) { *(u_uint32_t*)(b->mem + (address & b->mask)) = BE32(value); return; }
-	debugf("[MEM] unknown write32: %06x = %08x\n", (unsigned int)address, (unsigned int)value);
+// Write n words read from src to the VRAM data port, on behalf of a block
+// write loop run by the CPU core (see M68K_PORT_BURST in m68kconf.h).
+// Returns the last word.
+unsigned int hw_vram_data_burst(unsigned int src, unsigned int n) {
+	unsigned int val = 0;
+
+	while (n > 0) {
+		uint8_t *p = hw_rpages[(src >> 12) & 0xFFF];
+		unsigned int cnt = (0x1000 - (src & 0xFFF)) / 2;
+		if (cnt > n) cnt = n;
+
+		// Words in memory are host-endian only with MEM_SWAPPED. Writes must
+		// go through the slow path while they are being hooked.
+		if (MEM_SWAPPED && p && !(src & 1) && !hw_write_hook) {
+			const uint16_t *words = (const uint16_t*)(p + (src & 0xFFF));
+			if (likely(!profile_enabled)) lspc_vram_data_w_block(words, cnt);
+			else {
+				profile_hw_io -= TICKS_READ();
+				lspc_vram_data_w_block(words, cnt);
+				profile_hw_io += TICKS_READ();
+			}
+			val = words[cnt-1];
+		} else {
+			cnt = 1;
+			val = m68k_read_memory_16(src);
+			m68k_write_memory_16(0x3C0002, val);
+		}
+		src += cnt*2; n -= cnt;
+	}
+	return val;
 }
 #endif
 
@@ -237,21 +359,21 @@ void m68k_write_memory_32(unsigned int address, unsigned int value) {
 unsigned int m68k_read_disassembler_8(unsigned int address) {
 	Bank *b = &banks[(address>>20)&0xF];
 	if (b->mem)
-		return *(b->mem + (address & b->mask));
+		return b->mem[MEM_BYTE(address & b->mask)];
 	return 0xFFFFFFFF;
 }
 
 unsigned int m68k_read_disassembler_16(unsigned int address) {
 	Bank *b = &banks[(address>>20)&0xF];
 	if (b->mem)
-		return BE16(*(u_uint16_t*)(b->mem + (address & b->mask)));
+		return MEM16(*(u_uint16_t*)(b->mem + (address & b->mask)));
 	return 0xFFFFFFFF;
 }
 
 unsigned int m68k_read_disassembler_32(unsigned int address) {
 	Bank *b = &banks[(address>>20)&0xF];
 	if (b->mem)
-		return BE32(*(u_uint32_t*)(b->mem + (address & b->mask)));
+		return MEM32(*(u_uint32_t*)(b->mem + (address & b->mask)));
 	return 0xFFFFFFFF;
 }
 
@@ -261,6 +383,8 @@ void hw_init(void) {
 	memset(banks, 0, sizeof(banks));
 	memcpy(P_ROM_VECTOR, P_ROM, sizeof(P_ROM_VECTOR));
 	PALETTE_RAM_BANK = 0x0000;
+	FIX_ROM_BANK = 0;
+	video_dirty_reset(true);
 
 	banks[0x0] = (Bank){ P_ROM+0x000000,   0xFFFFF,   NULL,            write_unk };
 	banks[0x1] = (Bank){ WORK_RAM,         0x0FFFF,   NULL,            NULL };
@@ -272,6 +396,15 @@ void hw_init(void) {
 	banks[0x4] = (Bank){ NULL,             0x00000,   video_palette_r, video_palette_w };
 	banks[0xC] = (Bank){ BIOS,             0x1FFFF,   NULL,            write_unk };
 	banks[0xD] = (Bank){ BACKUP_RAM,       0x0FFFF,   NULL,            write_unk };
+	for (int i=0; i<16; i++)
+		map_bank(i);
+
+	#ifndef N64
+	// Code in ROM is decoded once by the CPU core
+	m68k_predecode_map(0x000000, 0x100000, 0);
+	m68k_predecode_map(0x200000, 0x100000, 0);
+	m68k_predecode_map(0xC00000, sizeof(BIOS), 0);
+	#endif
 
 	#ifdef N64
 	extern m64k_t m64k;
@@ -313,6 +446,11 @@ void hw_init(void) {
 
 	#endif
 
+	for (int i=0; i<16*128; i++)
+		mmio[i] = (MmioSlot){ mmio_read_unk, mmio_write_unk };
+	sys_init();
+	lspc_init();
+	input_init();
 	rtc_init_();
 	watchdog_init();
 }
@@ -12,10 +12,23 @@ extern uint16_t VIDEO_RAM[34*1024];
 
 extern uint16_t PALETTE_RAM[8*1024];  // two banks
 extern int PALETTE_RAM_BANK;
+extern int FIX_ROM_BANK;  // 0 = fixed (BIOS), 1 = game; applied by the renderer (see srom_set_bank)
+
+// Dirty tracking for incremental rendering: one byte per word of VIDEO_RAM,
+// and one per 16-colour palette of PALETTE_RAM (both banks). They are set
+// by writes, and cleared by video_render() after a frame is drawn.
+extern uint8_t VIDEO_RAM_DIRTY[34*1024];
+extern uint8_t PALETTE_RAM_DIRTY[8*1024/16];
 
 void hw_init(void);
 void hw_vblank(void);
 
 bool lspc_get_auto_animation(uint8_t *value);
+void lspc_vram_data_w(uint16_t val);
+void lspc_vram_data_w_block(const uint16_t *src, int n);
+
+#ifndef N64
+extern void (*hw_write_hook)(uint32_t addr, uint32_t val, int sz);
+#endif
 
 #endif
@@ -1,5 +1,6 @@
 
-static uint8_t input_p1cnt_r(void) {
+static uint32_t input_p1cnt_r(uint32_t addr, int sz) {
+	assert(sz==1);
 	uint8_t state = 0;
 	state |= (~keystate[PLAT_KEY_P1_UP] & 1) << 0;
 	state |= (~keystate[PLAT_KEY_P1_DOWN] & 1) << 1;
@@ -12,9 +13,17 @@ static uint8_t input_p1cnt_r(void) {
 	return state;
 }
 
-static uint8_t input_status_a_r(void) {
+static uint32_t input_status_a_r(uint32_t addr, int sz) {
+	assert(sz==1);
 	uint8_t state = 0;
 
+	// Idle skip for RTC Wait Pulse in BIOS boot
+	#if 0
+	if (emu_pc() == 0xC11DA2) {
+		m68k_consume_timeslice();
+	}
+	#endif
+
 	state |= (~keystate[PLAT_KEY_COIN_1] & 1) << 0;
 	state |= (~keystate[PLAT_KEY_COIN_2] & 1) << 1;
 	state |= (~keystate[PLAT_KEY_SERVICE] & 1) << 2;
@@ -26,7 +35,8 @@ static uint8_t input_status_a_r(void) {
 	return state;
 }
 
-static uint8_t input_status_b_r(void) {
+static uint32_t input_status_b_r(uint32_t addr, int sz) {
+	assert(sz==1);
 	uint8_t state = 0;
 
 	state |= (~keystate[PLAT_KEY_P1_START] & 1) << 0;
@@ -38,3 +48,9 @@ static uint8_t input_status_b_r(void) {
 
 	return state;
 }
+
+static void input_init(void) {
+	mmio_register(0x300000, 1, input_p1cnt_r,    NULL);
+	mmio_register(0x320001, 1, input_status_a_r, NULL);
+	mmio_register(0x380000, 1, input_status_b_r, NULL);
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include "lockstep.h"
+#include "m68kcpu.h"
+#include "m68kops.h"
+#include "hw.h"
+#include "platform.h"
+
+#if M68K_HLE
+#include "hle_index.h"
+#include "stb_ds.h"
+
+// Maximum number of interpreter steps for a single call
+#define MAX_STEPS        (1024*1024)
+
+// Number of interpreted instructions shown when a divergence is found
+#define TRACE_LEN        32
+
+extern uint16_t reg_vram_addr, reg_vram_mod, reg_vram_mask;
+extern uint16_t *reg_vram_bank;
+
+typedef struct {
+	uint32_t addr, val;
+	int sz;
+} Write;
+
+typedef struct {
+	Write *w;                       // stb_ds array
+} WriteLog;
+
+// State of the emulated machine that is directly modified by the CPU
+typedef struct {
+	m68ki_cpu_core cpu;
+	int cycles;
+	uint8_t wram[sizeof(WORK_RAM)];
+	uint16_t vram[sizeof(VIDEO_RAM)/2];
+	uint16_t *vram_bank;
+	uint16_t vram_addr, vram_mod, vram_mask;
+} MachineState;
+
+static MachineState st_pre, st_hle;
+static WriteLog log_hle, log_ref, *cur_log;
+static uint32_t trace[TRACE_LEN];
+static unsigned int calls;
+
+static void save_state(MachineState *s) {
+	s->cpu = m68ki_cpu;
+	s->cycles = GET_CYCLES();
+	memcpy(s->wram, WORK_RAM, sizeof(WORK_RAM));
+	memcpy(s->vram, VIDEO_RAM, sizeof(VIDEO_RAM));
+	s->vram_bank = reg_vram_bank;
+	s->vram_addr = reg_vram_addr;
+	s->vram_mod = reg_vram_mod;
+	s->vram_mask = reg_vram_mask;
+}
+
+static void restore_state(MachineState *s) {
+	m68ki_cpu = s->cpu;
+	SET_CYCLES(s->cycles);
+	memcpy(WORK_RAM, s->wram, sizeof(WORK_RAM));
+	memcpy(VIDEO_RAM, s->vram, sizeof(VIDEO_RAM));
+	reg_vram_bank = s->vram_bank;
+	reg_vram_addr = s->vram_addr;
+	reg_vram_mod = s->vram_mod;
+	reg_vram_mask = s->vram_mask;
+}
+
+// Record the writes to hardware registers. Writes to RAM are done through
+// the fast memory map and never reach the hook; the LSPC VRAM data port is
+// skipped, as the recompiled code can write it without going through hw.c.
+// Work RAM and VRAM are compared by content instead.
+static void write_hook(uint32_t addr, uint32_t val, int sz) {
+	addr &= 0xFFFFFF;
+	if ((addr >> 20) == 0x1 || addr == 0x3C0002) return;
+	arrput(cur_log->w, ((Write){ addr, val, sz }));
+}
+
+static uint16_t cpu_sr(m68ki_cpu_core *cpu) {
+	m68ki_cpu_core saved = m68ki_cpu;
+	m68ki_cpu = *cpu;
+	uint16_t sr = m68ki_get_sr();
+	m68ki_cpu = saved;
+	return sr;
+}
+
+static void dump_regs(const char *name, m68ki_cpu_core *cpu) {
+	debugf("[LOCKSTEP] %-6s PC=%06x SR=%04x\n", name, cpu->pc, cpu_sr(cpu));
+	for (int i=0; i<16; i++)
+		debugf("%s%c%d=%08x%s", i%8 ? "" : "[LOCKSTEP]   ", i<8 ? 'D' : 'A', i%8, cpu->dar[i], i%8 == 7 ? "\n" : " ");
+}
+
+static void divergence(uint32_t entry, int steps, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+// Report a divergence, with a disassembly of the last instructions run by
+// the interpreter, and stop the emulation.
+static void divergence(uint32_t entry, int steps, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	debugf("[LOCKSTEP] divergence in function %06x (call #%u): ", entry, calls);
+	vfprintf(stderr, fmt, args);
+	debugf("\n");
+	va_end(args);
+
+	dump_regs("hle:", &st_hle.cpu);
+	dump_regs("interp:", &m68ki_cpu);
+	debugf("[LOCKSTEP] last instructions run by the interpreter:\n");
+	int first = steps > TRACE_LEN ? steps - TRACE_LEN : 0;
+	for (int i=first; i<steps; i++) {
+		char inst[256];
+		uint32_t pc = trace[i % TRACE_LEN];
+		m68k_disassemble(inst, pc, M68K_CPU_TYPE_68000);
+		debugf("[LOCKSTEP]   %06x  %s\n", pc, inst);
+	}
+	exit(1);
+}
+
+// Run a single instruction with the interpreter.
+static void interp_step(void) {
+	REG_PPC = REG_PC;
+#if M68K_PREDECODE
+	m68ki_fetch_decoded();
+#else
+	REG_IR = m68ki_read_imm_16();
+#endif
+	m68ki_instruction_jump_table[REG_IR]();
+	USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+}
+
+static void compare(uint32_t entry, int steps) {
+	m68ki_cpu_core *a = &st_hle.cpu, *b = &m68ki_cpu;
+
+	if (a->pc != b->pc || st_hle.cycles != GET_CYCLES())
+		divergence(entry, steps, "exit PC/cycles: hle:%06x/%d interp:%06x/%d",
+			a->pc, st_pre.cycles - st_hle.cycles, b->pc, st_pre.cycles - GET_CYCLES());
+	for (int i=0; i<16; i++)
+		if (a->dar[i] != b->dar[i])
+			divergence(entry, steps, "%c%d: hle:%08x interp:%08x", i<8 ? 'D' : 'A', i%8, a->dar[i], b->dar[i]);
+	if (cpu_sr(a) != cpu_sr(b))
+		divergence(entry, steps, "SR: hle:%04x interp:%04x", cpu_sr(a), cpu_sr(b));
+	if (a->sp[0] != b->sp[0] || a->sp[4] != b->sp[4])
+		divergence(entry, steps, "USP/ISP: hle:%08x/%08x interp:%08x/%08x", a->sp[0], a->sp[4], b->sp[0], b->sp[4]);
+
+	for (int i=0; i<(int)sizeof(WORK_RAM); i++)
+		if (st_hle.wram[i] != WORK_RAM[i])
+			divergence(entry, steps, "work RAM at %06x: hle:%02x interp:%02x", 0x100000+MEM_BYTE(i), st_hle.wram[i], WORK_RAM[i]);
+	for (int i=0; i<(int)(sizeof(VIDEO_RAM)/2); i++)
+		if (st_hle.vram[i] != VIDEO_RAM[i])
+			divergence(entry, steps, "VRAM at %04x: hle:%04x interp:%04x", i, st_hle.vram[i], VIDEO_RAM[i]);
+	if (st_hle.vram_addr != reg_vram_addr || st_hle.vram_bank != reg_vram_bank)
+		divergence(entry, steps, "VRAM address: hle:%04x interp:%04x", st_hle.vram_addr, reg_vram_addr);
+
+	int nhle = arrlen(log_hle.w), nref = arrlen(log_ref.w);
+	for (int i=0; i<nhle || i<nref; i++) {
+		Write *wa = i < nhle ? &log_hle.w[i] : NULL;
+		Write *wb = i < nref ? &log_ref.w[i] : NULL;
+		if (!wa || !wb || wa->addr != wb->addr || wa->val != wb->val || wa->sz != wb->sz)
+			divergence(entry, steps, "hardware write #%d: hle:%06x<-%x (%d) interp:%06x<-%x (%d)", i,
+				wa ? wa->addr : 0, wa ? wa->val : 0, wa ? wa->sz*8 : 0,
+				wb ? wb->addr : 0, wb ? wb->val : 0, wb ? wb->sz*8 : 0);
+	}
+}
+
+// Run the recompiled function at pc, then run the interpreter from the same
+// state until it reaches the same exit point, and compare the results.
+// Hardware side effects (other than VRAM writes) are applied twice, which is
+// harmless for the registers that recompiled code usually touches.
+static unsigned int lockstep_call(unsigned int pc) {
+	const HLEFunc *f = hle_get_func(pc);
+	calls++;
+
+	save_state(&st_pre);
+	arrsetlen(log_hle.w, 0);
+	cur_log = &log_hle;
+	hw_write_hook = write_hook;
+	uint32_t exit_pc = f->func(&m68ki_cpu, &m68ki_remaining_cycles, pc);
+	REG_PC = exit_pc;
+	save_state(&st_hle);
+
+	// Run the interpreter up to the same point. The recompiled code exits
+	// at instruction boundaries, after having accounted all the cycles of the
+	// instructions it run, so both the PC and the cycles must match.
+	restore_state(&st_pre);
+	arrsetlen(log_ref.w, 0);
+	cur_log = &log_ref;
+	int steps = 0;
+	while (GET_CYCLES() > st_hle.cycles && steps < MAX_STEPS) {
+		trace[steps++ % TRACE_LEN] = REG_PC;
+		interp_step();
+	}
+	hw_write_hook = NULL;
+
+	compare(pc, steps);
+	return REG_PC;
+}
+
+void lockstep_start(void) {
+	calls = 0;
+	m68k_set_hle_call_callback(lockstep_call);
+}
+
+void lockstep_stop(void) {
+	m68k_set_hle_call_callback(NULL);
+	printf("[LOCKSTEP] %u calls to recompiled functions verified\n", calls);
+}
+
+#else
+
+void lockstep_start(void) {
+	assertf(0, "lockstep: recompiled functions not available (M68K_HLE is off)");
+}
+
+void lockstep_stop(void) {}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+// Differential tester for the functions recompiled by genhle (PC only).
+//
+// Every call to a recompiled function is executed twice from the same CPU
+// state: once by the recompiled code, and once by the Musashi interpreter.
+// Registers, SR, cycles and memory writes of the two runs are compared, and
+// emulation stops at the first divergence with a disassembly of the code
+// that was executed.
+
+void lockstep_start(void);
+void lockstep_stop(void);
+
+#endif /* LOCKSTEP_H */
@@ -7,17 +7,49 @@ static uint16_t reg_lspcmode;
 static uint8_t lspc_aa_counter;
 static uint8_t lspc_aa_tick;
 
-static void lspc_vram_data_w(uint16_t val) {
+void lspc_vram_data_w(uint16_t val) {
 	reg_vram_bank[reg_vram_addr] = val;
+	VIDEO_RAM_DIRTY[reg_vram_bank - VIDEO_RAM + reg_vram_addr] = 1;
 	reg_vram_addr += reg_vram_mod;
 	reg_vram_addr &= reg_vram_mask;
 }
 
-static uint16_t lspc_vram_data_r(void) {
-	return reg_vram_bank[reg_vram_addr];
+// Write a block of words to the VRAM data port, as if they were written one
+// by one (including the modulo stepping).
+void lspc_vram_data_w_block(const uint16_t *src, int n) {
+	if (reg_vram_mod == 1 && reg_vram_addr + n <= reg_vram_mask + 1) {
+		memcpy(reg_vram_bank + reg_vram_addr, src, n*2);
+		memset(VIDEO_RAM_DIRTY + (reg_vram_bank - VIDEO_RAM) + reg_vram_addr, 1, n);
+		reg_vram_addr = (reg_vram_addr + n) & reg_vram_mask;
+		return;
+	}
+	while (n-- > 0)
+		lspc_vram_data_w(*src++);
+}
+
+// The registers are 16-bit, but they can be accessed with byte accesses too:
+// a byte read returns the addressed half of the word, while a byte write puts
+// the byte on both halves of the data bus, as the 68000 does.
+static uint32_t lspc_reg_r(uint32_t addr, int sz, uint16_t val) {
+	if (sz == 2) return val;
+	return (addr & 1) ? (val & 0xFF) : (val >> 8);
+}
+
+static uint16_t lspc_reg_w(uint32_t val, int sz) {
+	if (sz == 2) return val;
+	return (val & 0xFF) * 0x101;
+}
+
+static void lspc_vram_data_mmio_w(uint32_t addr, uint32_t val, int sz) {
+	lspc_vram_data_w(lspc_reg_w(val, sz));
 }
 
-static void lspc_vram_addr_w(uint32_t val) {
+static uint32_t lspc_vram_data_r(uint32_t addr, int sz) {
+	return lspc_reg_r(addr, sz, reg_vram_bank[reg_vram_addr]);
+}
+
+static void lspc_vram_addr_w(uint32_t addr, uint32_t val, int sz) {
+	val = lspc_reg_w(val, sz);
 	if (!(val & 0x8000)) {
 		reg_vram_bank = VIDEO_RAM;
 		reg_vram_mask = 0x7FFF;
@@ -29,28 +61,46 @@ static void lspc_vram_addr_w(uint32_t val) {
 	reg_vram_addr = val & reg_vram_mask;
 }
 
-static void lspc_vram_modulo_w(uint16_t val) {
-	reg_vram_mod = val;
+static void lspc_vram_modulo_w(uint32_t addr, uint32_t val, int sz) {
+	reg_vram_mod = lspc_reg_w(val, sz);
 }
 
-static uint16_t lspc_vram_modulo_r(void) {
-	return reg_vram_mod;
+static uint32_t lspc_vram_modulo_r(uint32_t addr, int sz) {
+	return lspc_reg_r(addr, sz, reg_vram_mod);
 }
 
-static uint16_t lspc_mode_r() {
+static uint32_t lspc_mode_r(uint32_t addr, int sz) {
 	int64_t clk = emu_clock_frame();
 	int line = clk / (MVS_CLOCK / FPS / 264);
 
-	return ((line+0xF8) << 7) | (lspc_aa_counter & 7);
+	return lspc_reg_r(addr, sz, ((line+0xF8) << 7) | (lspc_aa_counter & 7));
 }
 
-static void lspc_mode_w(uint16_t val) {
+static void lspc_mode_w(uint32_t addr, uint32_t val, int sz) {
+	val = lspc_reg_w(val, sz);
 	reg_lspcmode = val;
 
 	if (val & (1<<4))
 		debugf("[LSPC] Timer interrupt **************************\n");
 }
 
+static void lspc_irq_ack_w(uint32_t addr, uint32_t val, int sz) {
+	if (val&1) emu_cpu_irq(3,false);
+	if (val&2) emu_cpu_irq(2,false);
+	if (val&4) emu_cpu_irq(1,false);
+}
+
+static void lspc_init(void) {
+	mmio_register(0x3C0000, 2, lspc_vram_data_r,   lspc_vram_addr_w);
+	mmio_register(0x3C0002, 2, lspc_vram_data_r,   lspc_vram_data_mmio_w);
+	mmio_register(0x3C0004, 2, lspc_vram_modulo_r, lspc_vram_modulo_w);
+	mmio_register(0x3C0006, 2, lspc_mode_r,        lspc_mode_w);
+	mmio_register(0x3C0008, 2, lspc_vram_data_r,   NULL);
+	mmio_register(0x3C000A, 2, lspc_vram_data_r,   NULL);
+	mmio_register(0x3C000C, 2, lspc_vram_modulo_r, lspc_irq_ack_w);
+	mmio_register(0x3C000E, 2, lspc_mode_r,        NULL);
+}
+
 static void lspc_vblank(void) {
 	if (lspc_aa_tick == 0) {
 		lspc_aa_tick = reg_lspcmode >> 8;
@@ -332,6 +332,36 @@ void m68k_modify_timeslice(int cycles); /* Modify cycles left */
 void m68k_end_timeslice(void);          /* End timeslice now */
 void m68k_consume_timeslice(void);      /* End timeslice now, pretending it was consumed */
 
+/* Enable or disable the execution of functions recompiled by genhle (only
+ * available when the core is compiled with M68K_HLE, see m68kconf.h).
+ */
+void m68k_set_hle_enabled(int enable);
+
+/* Get statistics on the execution of recompiled functions: number of calls,
+ * and cycles spent in recompiled code and in the interpreter since the last
+ * reset of the statistics.
+ */
+void m68k_get_hle_stats(unsigned int *calls, unsigned long long *hle_cycles, unsigned long long *interp_cycles);
+void m68k_reset_hle_stats(void);
+
+/* Install a callback that is invoked in place of a recompiled function, when
+ * the PC reaches one of its entrypoints (NULL to restore the default).
+ * The callback receives the PC, must run the function and return the PC at
+ * which the interpreter will resume. This is used by the lockstep tester.
+ */
+void m68k_set_hle_call_callback(unsigned int (*callback)(unsigned int pc));
+
+/* Predecoded instruction cache (see M68K_PREDECODE in m68kconf.h).
+ * m68k_predecode_map() declares that the range contains read-only code,
+ * whose current contents are identified by bank (0-7): the instructions
+ * decoded in each bank are kept, so that mapping a bank back is free.
+ * Address and size must be multiples of 4 KiB.
+ * m68k_predecode_invalidate() drops the instructions decoded in a range
+ * (in all its banks), and must be called if its contents change.
+ */
+void m68k_predecode_map(unsigned int address, unsigned int size, unsigned int bank);
+void m68k_predecode_invalidate(unsigned int address, unsigned int size);
+
 /* Set the IPL0-IPL2 pins on the CPU (IRQ).
  * A transition from < 7 to 7 will cause a non-maskable interrupt (NMI).
  * Setting IRQ to 0 will clear an interrupt request.
@@ -159,28 +159,141 @@
 
 #define m68ki_jump(pc)       ({ REG_PC = pc; })
 #define m68ki_branch_8(pc)   ({ REG_PC += MAKE_INT_8(pc); })
+#define m68ki_branch_16(pc)  ({ REG_PC += MAKE_INT_16(pc); })
 
 #define m68ki_cpu (*__m68ki_cpu)
 #define m68ki_remaining_cycles (*__m68ki_remaining_cycles)
 
+/**
+ * Memory accesses.
+ *
+ * When genhle can prove statically the memory region accessed by an opcode
+ * (absolute and PC-relative addressing), it declares it in the opcode scope
+ * by shadowing HLE_MEM_R (for reads) and HLE_MEM_W (for writes). The
+ * accessors below then resolve at compile time into a direct access to the
+ * memory buffer (or to the LSPC VRAM data port), skipping the bank table
+ * in hw.c. Other accesses go through a guarded path, that still accesses
+ * work RAM directly and falls back to the generic memory handlers.
+ */
+#include "hw.h"
+#include "roms.h"
+#include "platform.h"
+
+#define HLE_MEM_ANY         0
+#define HLE_MEM_WRAM        1
+#define HLE_MEM_PROM        2
+#define HLE_MEM_BIOS        3
+#define HLE_MEM_VRAM_DATA   4
+
+enum { HLE_MEM_R = HLE_MEM_ANY, HLE_MEM_W = HLE_MEM_ANY };
+
+typedef uint16_t hle_u16_t __attribute__((aligned(1)));
+typedef uint32_t hle_u32_t __attribute__((aligned(1)));
+
+static inline uint8_t* hle_mem_ptr(int region, uint address) {
+	switch (region) {
+	case HLE_MEM_WRAM: return &WORK_RAM[address & 0xFFFF];
+	case HLE_MEM_PROM: return &P_ROM[address & 0xFFFFF];
+	case HLE_MEM_BIOS: return &BIOS[address & 0x1FFFF];
+	}
+	if ((address & 0xF00000) == 0x100000)
+		return &WORK_RAM[address & 0xFFFF];
+	return NULL;
+}
+
+static inline uint hle_read_8(int region, uint address) {
+	uint8_t *p = hle_mem_ptr(region, MEM_BYTE(address));
+	if (p) return *p;
+	return m68k_read_memory_8(ADDRESS_68K(address));
+}
+
+static inline uint hle_read_16(int region, uint address) {
+	uint8_t *p = hle_mem_ptr(region, address);
+	if (p) return MEM16(*(hle_u16_t*)p);
+	return m68k_read_memory_16(ADDRESS_68K(address));
+}
+
+static inline uint hle_read_32(int region, uint address) {
+	uint8_t *p = hle_mem_ptr(region, address);
+	if (p) return MEM32(*(hle_u32_t*)p);
+	return m68k_read_memory_32(ADDRESS_68K(address));
+}
+
+static inline void hle_write_8(int region, uint address, uint value) {
+	if (region == HLE_MEM_WRAM || (region == HLE_MEM_ANY && (address & 0xF00000) == 0x100000)) {
+		WORK_RAM[MEM_BYTE(address) & 0xFFFF] = value;
+		return;
+	}
+	m68k_write_memory_8(ADDRESS_68K(address), value);
+}
+
+static inline void hle_write_16(int region, uint address, uint value) {
+	if (region == HLE_MEM_VRAM_DATA) {
+		// Account the time like the memory handlers do (see hwio_write)
+		extern uint32_t profile_hw_io;
+		extern bool profile_enabled;
+		if (likely(!profile_enabled)) lspc_vram_data_w(value);
+		else {
+			profile_hw_io -= TICKS_READ();
+			lspc_vram_data_w(value);
+			profile_hw_io += TICKS_READ();
+		}
+		return;
+	}
+	if (region == HLE_MEM_WRAM || (region == HLE_MEM_ANY && (address & 0xF00000) == 0x100000)) {
+		*(hle_u16_t*)&WORK_RAM[address & 0xFFFF] = MEM16(value);
+		return;
+	}
+	m68k_write_memory_16(ADDRESS_68K(address), value);
+}
+
+static inline void hle_write_32(int region, uint address, uint value) {
+	if (region == HLE_MEM_WRAM || (region == HLE_MEM_ANY && (address & 0xF00000) == 0x100000)) {
+		*(hle_u32_t*)&WORK_RAM[address & 0xFFFF] = MEM32(value);
+		return;
+	}
+	m68k_write_memory_32(ADDRESS_68K(address), value);
+}
+
+#undef m68ki_read_8
+#undef m68ki_read_16
+#undef m68ki_read_32
+#undef m68ki_write_8
+#undef m68ki_write_16
+#undef m68ki_write_32
+#undef m68ki_read_pcrel_8
+#undef m68ki_read_pcrel_16
+#undef m68ki_read_pcrel_32
+
+#define m68ki_read_8(A)         hle_read_8(HLE_MEM_R, A)
+#define m68ki_read_16(A)        hle_read_16(HLE_MEM_R, A)
+#define m68ki_read_32(A)        hle_read_32(HLE_MEM_R, A)
+#define m68ki_write_8(A, V)     hle_write_8(HLE_MEM_W, A, V)
+#define m68ki_write_16(A, V)    hle_write_16(HLE_MEM_W, A, V)
+#define m68ki_write_32(A, V)    hle_write_32(HLE_MEM_W, A, V)
+#define m68ki_read_pcrel_8(A)   hle_read_8(HLE_MEM_R, A)
+#define m68ki_read_pcrel_16(A)  hle_read_16(HLE_MEM_R, A)
+#define m68ki_read_pcrel_32(A)  hle_read_32(HLE_MEM_R, A)
+
+// The stack is never in a statically known region
 #define m68ki_push_16(value) ({ \
 	REG_SP = MASK_OUT_ABOVE_32(REG_SP - 2); \
-	m68ki_write_16(REG_SP, value); \
+	hle_write_16(HLE_MEM_ANY, REG_SP, value); \
 })
 
 #define m68ki_push_32(value) ({ \
 	REG_SP = MASK_OUT_ABOVE_32(REG_SP - 4); \
-	m68ki_write_32(REG_SP, value); \
+	hle_write_32(HLE_MEM_ANY, REG_SP, value); \
 })
 
 #define m68ki_pull_16() ({ \
 	REG_SP = MASK_OUT_ABOVE_32(REG_SP + 2); \
-	m68ki_read_16(REG_SP-2); \
+	hle_read_16(HLE_MEM_ANY, REG_SP-2); \
 })
 
 #define m68ki_pull_32() ({ \
 	REG_SP = MASK_OUT_ABOVE_32(REG_SP + 4); \
-	m68ki_read_32(REG_SP-4); \
+	hle_read_32(HLE_MEM_ANY, REG_SP-4); \
 })
 
 #define m68ki_set_ccr(_VAL) ({ \
@@ -151,12 +151,49 @@
 #define M68K_EMULATE_FC             OPT_OFF
 #define M68K_SET_FC_CALLBACK(A)     your_set_fc_handler_function(A)
 
+/* If ON, the CPU will run the functions recompiled by genhle (hle_*.c)
+ * whenever execution jumps to one of their entrypoints. This is turned on
+ * by the Makefile when hle_index.c is present. HLE uses the pc changed
+ * hook to find out when a jump happened, so it takes over M68K_MONITOR_PC.
+ */
+#ifndef M68K_HLE
+#define M68K_HLE                    OPT_OFF
+#endif
+
+/* If ON, instructions are fetched from a cache of predecoded instructions
+ * (handler, cycles and extension words) for the address ranges declared
+ * as read-only code with m68k_predecode_map(). Instructions elsewhere are
+ * decoded every time they are executed.
+ */
+#ifndef M68K_PREDECODE
+#define M68K_PREDECODE              OPT_ON
+#endif
+
+/* If ON, loops that write a block of words to an I/O port:
+ *     loop: move.w (Ay)+,(M68K_PORT_BURST_ADDR).l
+ *           dbf    Dx,loop
+ * are recognized when they are predecoded, and run at once (up to the end of
+ * the timeslice) by calling M68K_PORT_BURST_CALLBACK(src, count), that must
+ * write count words read from src to the port and return the last one.
+ * Requires M68K_PREDECODE. On Neo Geo, this is the LSPC VRAM data port.
+ */
+#ifndef M68K_PORT_BURST
+#define M68K_PORT_BURST             OPT_ON
+#endif
+#define M68K_PORT_BURST_ADDR        0x3C0002
+#define M68K_PORT_BURST_CALLBACK(src, n) hw_vram_data_burst(src, n)
+
 /* If ON, CPU will call the pc changed callback when it changes the PC by a
  * large value.  This allows host programs to be nicer when it comes to
  * fetching immediate data and instructions on a banked memory system.
  */
+#if M68K_HLE
+#define M68K_MONITOR_PC             OPT_SPECIFY_HANDLER
+#define M68K_SET_PC_CALLBACK(A)     (m68ki_hle_check = 1)
+#else
 #define M68K_MONITOR_PC             OPT_ON
 #define M68K_SET_PC_CALLBACK(A)     your_pc_changed_handler_function(A)
+#endif
 
 
 /* If ON, CPU will call the instruction hook callback before every
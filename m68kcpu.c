@@ -45,8 +45,13 @@ extern unsigned char m68ki_cycles[][0x10000];
 extern void (*m68ki_instruction_jump_table[0x10000])(void); /* opcode handler jump table */
 extern void m68ki_build_opcode_table(void);
 
+#include <stdio.h>
+#include <stdlib.h>
 #include "m68kops.h"
 #include "m68kcpu.h"
+#if M68K_HLE
+#include "hle_index.h"
+#endif
 
 // #include "m68kfpu.c"
 // #include "m68kmmu.h" // uses some functions from m68kfpu.c which are static !
@@ -90,6 +95,27 @@ uint    m68ki_aerr_address;
 uint    m68ki_aerr_write_mode;
 uint    m68ki_aerr_fc;
 
+/* HLE (recompiled functions) state and statistics */
+#if M68K_HLE
+int     m68ki_hle_check;                             /* PC changed by a jump: check for HLE entrypoint */
+static int m68ki_hle_resync;                         /* the interpreter is running a block of recompiled code */
+static uint m68ki_hle_resync_pc = 1;                 /* resume the block at this PC, after an interrupt */
+#endif
+int     m68ki_hle_enabled = 1;
+unsigned int (*m68ki_hle_call_callback)(unsigned int pc);
+uint    m68ki_hle_calls;
+unsigned long long m68ki_hle_cycles;
+unsigned long long m68ki_total_cycles;
+
+/* Predecoded instruction cache, with 4 KiB pages */
+#if M68K_PREDECODE
+#define PREDECODE_BANKS 8
+m68ki_decoded *m68ki_predecode_pages[0x1000];                       /* Decoded instructions of the mapped pages */
+const uint16  *m68ki_predecode_imm;                                 /* Extension words of the current instruction */
+static m68ki_decoded *m68ki_predecode_banks[0x1000][PREDECODE_BANKS]; /* Decoded instructions of each bank */
+static m68ki_decoded **m68ki_predecode_slot[0x1000];                /* Mapped bank (NULL if not cached) */
+#endif
+
 jmp_buf m68ki_bus_error_jmp_buf;
 
 /* Used by shift & rotate instructions */
@@ -941,6 +967,269 @@ void m68k_set_cpu_type(unsigned int cpu_type)
 
 /* Execute some instructions until we use up num_cycles clock cycles */
 /* ASG: removed per-instruction interrupt checks */
+#if M68K_HLE
+/* Run a single instruction with the interpreter */
+static void m68ki_hle_step(void)
+{
+	m68ki_instr_hook(REG_PC); /* auto-disable (see m68kcpu.h) */
+	REG_PPC = REG_PC;
+#if M68K_PREDECODE
+	{
+		const m68ki_decoded *d = m68ki_fetch_decoded();
+		d->handler();
+		USE_CYCLES(d->cycles);
+	}
+#else
+	REG_IR = m68ki_read_imm_16();
+	m68ki_instruction_jump_table[REG_IR]();
+	USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+#endif
+}
+
+/* Run recompiled functions as long as the PC points to one of their
+ * entrypoints. Recompiled functions return to the interpreter when they
+ * jump to a target they do not know (eg: a call to a non-recompiled
+ * function, or a return), which might in turn be a HLE entrypoint.
+ */
+static void m68ki_hle_execute(void)
+{
+	const HLEFunc *f;
+
+	while(GET_CYCLES() > 0)
+	{
+		/* Finish with the interpreter the block that was left to it (see
+		 * below), also across timeslices, up to the next block or jump.
+		 */
+		if(m68ki_hle_resync)
+		{
+			m68ki_hle_step();
+			if(m68ki_hle_check || hle_get_func(ADDRESS_68K(REG_PC)))
+				m68ki_hle_resync = m68ki_hle_check = 0;
+			continue;
+		}
+
+		f = hle_get_func(ADDRESS_68K(REG_PC));
+		if(f == NULL)
+		{
+			/* Back from an interrupt taken in the middle of the block */
+			if(REG_PC != m68ki_hle_resync_pc)
+				break;
+			m68ki_hle_resync = 1;
+			m68ki_hle_resync_pc = 1;
+			continue;
+		}
+
+		int cycles = GET_CYCLES();
+		REG_PPC = REG_PC;
+		if(m68ki_hle_call_callback)
+			REG_PC = m68ki_hle_call_callback(ADDRESS_68K(REG_PC));
+		else
+			REG_PC = f->func(&m68ki_cpu, &m68ki_remaining_cycles, ADDRESS_68K(REG_PC));
+		m68ki_hle_calls++;
+		m68ki_hle_cycles += cycles - GET_CYCLES();
+
+		/* The function returns where it was entered, without running
+		 * anything, when the timeslice ends within the first block: let
+		 * the interpreter run it, to stop at the exact instruction.
+		 */
+		if(ADDRESS_68K(REG_PC) == ADDRESS_68K(REG_PPC) && GET_CYCLES() == cycles)
+		{
+			m68ki_hle_resync = 1;
+			m68ki_hle_check = 0;
+			continue;
+		}
+
+		/* An access to the hardware ended the timeslice in the middle of a
+		 * block: the interpreter finishes it in the next timeslice.
+		 */
+		if(GET_CYCLES() <= 0 && !hle_get_func(ADDRESS_68K(REG_PC)))
+		{
+			m68ki_hle_resync = 1;
+			m68ki_hle_check = 0;
+			continue;
+		}
+
+		/* A recompiled function also exits on opcodes that it leaves to
+		 * the interpreter; the function can be resumed right after it.
+		 */
+		m68ki_hle_check = 1;
+	}
+}
+#endif
+
+void m68k_set_hle_enabled(int enable)
+{
+	m68ki_hle_enabled = enable;
+}
+
+void m68k_set_hle_call_callback(unsigned int (*callback)(unsigned int pc))
+{
+	m68ki_hle_call_callback = callback;
+}
+
+void m68k_get_hle_stats(unsigned int *calls, unsigned long long *hle_cycles, unsigned long long *interp_cycles)
+{
+	*calls = m68ki_hle_calls;
+	*hle_cycles = m68ki_hle_cycles;
+	*interp_cycles = m68ki_total_cycles - m68ki_hle_cycles;
+}
+
+void m68k_reset_hle_stats(void)
+{
+	m68ki_hle_calls = 0;
+	m68ki_hle_cycles = 0;
+	m68ki_total_cycles = 0;
+}
+
+#if M68K_PREDECODE
+/* Decode the instruction at pc, which is not in the cache. Instructions that
+ * are not in read-only code are decoded in a scratch entry.
+ */
+const m68ki_decoded *m68ki_predecode_miss(uint pc)
+{
+	static m68ki_decoded scratch;
+	m68ki_decoded **slot = m68ki_predecode_slot[pc >> 12];
+	m68ki_decoded *d = &scratch;
+	uint i;
+
+	if(slot)
+	{
+		if(*slot == NULL)
+		{
+			*slot = calloc(0x800, sizeof(m68ki_decoded));
+			if(*slot == NULL)
+			{
+				fprintf(stderr, "cannot allocate predecode page\n");
+				abort();
+			}
+			m68ki_predecode_pages[pc >> 12] = *slot;
+		}
+		d = &(*slot)[(pc & 0xfff) >> 1];
+	}
+
+	d->ir = m68k_read_immediate_16(pc);
+	d->handler = m68ki_instruction_jump_table[d->ir];
+	d->cycles = CYC_INSTRUCTION[d->ir];
+
+	/* Do not fetch extension words past the end of the 1 MiB area, which
+	 * might be followed by I/O registers.
+	 */
+	for(i = 0; i < 4 && ((pc + 2 + i*2) >> 20) == (pc >> 20); i++)
+		d->ext[i] = m68k_read_immediate_16(pc + 2 + i*2);
+	for(; i < 4; i++)
+		d->ext[i] = 0;
+
+#if M68K_PORT_BURST
+	/* move.w (Ay)+,(port).l followed by dbf Dx back to it: the extension
+	 * words contain the whole loop.
+	 */
+	if((d->ir & 0xfff8) == 0x33d8 &&
+	   ((d->ext[0] << 16) | d->ext[1]) == M68K_PORT_BURST_ADDR &&
+	   (d->ext[2] & 0xfff8) == 0x51c8 && d->ext[3] == 0xfff8)
+	{
+		d->handler = m68ki_port_burst;
+		d->cycles = 0;
+	}
+#endif
+	d->valid = 1;
+	return d;
+}
+#endif
+
+#if M68K_PORT_BURST
+/* Run a block write loop to an I/O port (see M68K_PORT_BURST in m68kconf.h),
+ * starting from its move. Iterations are counted exactly as the interpreter
+ * would execute them, so that the loop stops at the same instruction when the
+ * timeslice is over; then, the words are written with a single call.
+ * This handler accounts all the cycles itself.
+ */
+void m68ki_port_burst(void)
+{
+	uint pc = REG_PC - 2;
+	uint* r_src = &REG_A[REG_IR & 7];
+	uint* r_cnt = &REG_D[m68ki_predecode_imm[2] & 7];
+	uint dbf = m68ki_predecode_imm[2];
+	int cyc_move = CYC_INSTRUCTION[REG_IR];
+	int cyc_loop = CYC_INSTRUCTION[dbf] + CYC_DBCC_F_NOEXP;
+	int cyc_exit = CYC_INSTRUCTION[dbf] + CYC_DBCC_F_EXP;
+	int cycles = GET_CYCLES();
+	uint cnt = MASK_OUT_ABOVE_16(*r_cnt);
+	uint n = 0;
+	uint res;
+
+	/* Let the instruction hook see every instruction, and the idle skip
+	 * check see the branch.
+	 */
+	if(CALLBACK_INSTR_HOOK != default_instr_hook_callback || m68k_check_idle_skip(pc))
+	{
+		m68ki_instruction_jump_table[REG_IR]();
+		USE_CYCLES(cyc_move);
+		return;
+	}
+
+	for(;;)
+	{
+		n++;
+		cycles -= cyc_move;
+		if(cycles <= 0)
+		{
+			REG_PC = pc + 6;            /* stop before the dbf */
+			break;
+		}
+		cnt = MASK_OUT_ABOVE_16(cnt - 1);
+		if(cnt == 0xffff)
+		{
+			cycles -= cyc_exit;
+			REG_PC = pc + 10;           /* loop is over */
+			break;
+		}
+		cycles -= cyc_loop;
+		if(cycles <= 0)
+		{
+			REG_PC = pc;                /* stop before the next move */
+			break;
+		}
+	}
+
+	res = M68K_PORT_BURST_CALLBACK(ADDRESS_68K(*r_src), n);
+	*r_src += n * 2;
+	*r_cnt = MASK_OUT_BELOW_16(*r_cnt) | cnt;
+	SET_CYCLES(cycles);
+
+	FLAG_N = NFLAG_16(res);
+	FLAG_Z = res;
+	FLAG_V = VFLAG_CLEAR;
+	FLAG_C = CFLAG_CLEAR;
+}
+#endif
+
+void m68k_predecode_map(unsigned int address, unsigned int size, unsigned int bank)
+{
+#if M68K_PREDECODE
+	uint page;
+
+	for(page = address >> 12; page < (address + size) >> 12; page++)
+	{
+		m68ki_predecode_slot[page & 0xfff] = &m68ki_predecode_banks[page & 0xfff][bank % PREDECODE_BANKS];
+		m68ki_predecode_pages[page & 0xfff] = m68ki_predecode_banks[page & 0xfff][bank % PREDECODE_BANKS];
+	}
+#endif
+}
+
+void m68k_predecode_invalidate(unsigned int address, unsigned int size)
+{
+#if M68K_PREDECODE
+	/* The extension words of an instruction might start up to 8 bytes earlier */
+	uint addr = address >= 8 ? (address - 8) & ~1 : 0;
+	int i;
+
+	for(; addr < address + size; addr += 2)
+		for(i = 0; i < PREDECODE_BANKS; i++)
+			if(m68ki_predecode_banks[(addr >> 12) & 0xfff][i])
+				m68ki_predecode_banks[(addr >> 12) & 0xfff][i][(addr & 0xfff) >> 1].valid = 0;
+#endif
+}
+
 int m68k_execute(int num_cycles)
 {
 	/* eat up any reset cycles */
@@ -957,6 +1246,19 @@ int m68k_execute(int num_cycles)
 	m68ki_initial_cycles = num_cycles;
 
 	/* See if interrupts came in */
+#if M68K_HLE
+	if(m68ki_hle_resync)
+	{
+		uint pc = REG_PC;
+		m68ki_check_interrupts();
+		if(REG_PC != pc)
+		{
+			m68ki_hle_resync = 0;
+			m68ki_hle_resync_pc = pc;
+		}
+	}
+	else
+#endif
 	m68ki_check_interrupts();
 
 	/* Make sure we're not stopped */
@@ -968,9 +1270,28 @@ int m68k_execute(int num_cycles)
 		//rasky: disable bus error for performance
 		//m68ki_check_bus_error_trap();
 
+#if M68K_HLE
+		/* Resume recompiled code interrupted by the end of the timeslice */
+		m68ki_hle_check = 1;
+#endif
+
 		/* Main loop.  Keep going until we run out of clock cycles */
 		do
 		{
+#if M68K_HLE
+			/* After a jump, see if we landed on a recompiled function */
+			if(m68ki_hle_check)
+			{
+				m68ki_hle_check = 0;
+				if(m68ki_hle_enabled)
+				{
+					m68ki_hle_execute();
+					if(GET_CYCLES() <= 0)
+						break;
+				}
+			}
+#endif
+
 			//int i;
 			/* Set tracing accodring to T1. (T0 is done inside instruction) */
 			m68ki_trace_t1(); /* auto-disable (see m68kcpu.h) */
@@ -991,9 +1312,17 @@ int m68k_execute(int num_cycles)
 			}
 #endif
 			/* Read an instruction and call its handler */
+#if M68K_PREDECODE
+			{
+				const m68ki_decoded *d = m68ki_fetch_decoded();
+				d->handler();
+				USE_CYCLES(d->cycles);
+			}
+#else
 			REG_IR = m68ki_read_imm_16();
 			m68ki_instruction_jump_table[REG_IR]();
 			USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+#endif
 
 			/* Trace m68k_exception, if necessary */
 			m68ki_exception_if_trace(); /* auto-disable (see m68kcpu.h) */
@@ -1009,6 +1338,7 @@ int m68k_execute(int num_cycles)
 	/* RASKY: changed this to make sure that after calling m68k_consume_timeslice,
 	 * m68k_run reports that the timeslice was fully consumed (for idle skip!) */
 	int spent_cycles = m68ki_initial_cycles - GET_CYCLES();
+	m68ki_total_cycles += spent_cycles;
 	m68ki_initial_cycles = 0;
 	SET_CYCLES(0);
 	return spent_cycles;
@@ -1145,8 +1475,13 @@ void m68k_pulse_reset(void)
 
 	/* Read the initial stack pointer and program counter */
 	m68ki_jump(0);
+#if M68K_PREDECODE
+	REG_SP = m68k_read_immediate_32(0);
+	REG_PC = m68k_read_immediate_32(4);
+#else
 	REG_SP = m68ki_read_imm_32();
 	REG_PC = m68ki_read_imm_32();
+#endif
 	m68ki_jump(REG_PC);
 
 	CPU_RUN_MODE = RUN_MODE_NORMAL;
@@ -1019,6 +1019,35 @@ extern uint           m68ki_aerr_address;
 extern uint           m68ki_aerr_write_mode;
 extern uint           m68ki_aerr_fc;
 
+#if M68K_HLE
+extern int            m68ki_hle_check;
+#endif
+
+#if M68K_PREDECODE
+/* A predecoded instruction. The extension words are fetched without knowing
+ * the length of the instruction, so some of them might not belong to it.
+ */
+typedef struct
+{
+	void (*handler)(void);     /* Opcode handler */
+	uint16 ir;                 /* Opcode */
+	uint8 cycles;              /* Cycles of the opcode */
+	uint8 valid;               /* Zero if the entry must be decoded */
+	uint16 ext[4];             /* Extension words */
+} m68ki_decoded;
+
+extern m68ki_decoded *m68ki_predecode_pages[0x1000];
+extern const uint16  *m68ki_predecode_imm;
+const m68ki_decoded *m68ki_predecode_miss(uint pc);
+#endif
+
+#if M68K_PORT_BURST
+#if !M68K_PREDECODE
+#error "M68K_PORT_BURST requires M68K_PREDECODE"
+#endif
+void m68ki_port_burst(void);
+#endif
+
 /* Forward declarations to keep some of the macros happy */
 static inline uint m68ki_read_16_fc (uint address, uint fc);
 static inline uint m68ki_read_32_fc (uint address, uint fc);
@@ -1059,7 +1088,10 @@ static inline uint m68ki_read_imm_16(void)
 #endif
 #endif
 
-#if M68K_EMULATE_PREFETCH
+#if M68K_PREDECODE
+	REG_PC += 2;
+	return *m68ki_predecode_imm++;
+#elif M68K_EMULATE_PREFETCH
 {
 	uint result;
 	if(REG_PC != CPU_PREF_ADDR)
@@ -1094,7 +1126,12 @@ static inline uint m68ki_read_imm_32(void)
 #endif
 #endif
 
-#if M68K_EMULATE_PREFETCH
+#if M68K_PREDECODE
+	uint temp_val = (m68ki_predecode_imm[0] << 16) | m68ki_predecode_imm[1];
+	m68ki_predecode_imm += 2;
+	REG_PC += 4;
+	return temp_val;
+#elif M68K_EMULATE_PREFETCH
 	uint temp_val;
 
 	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
@@ -1123,6 +1160,27 @@ static inline uint m68ki_read_imm_32(void)
 	return m68k_read_immediate_32(ADDRESS_68K(REG_PC-4));
 #endif /* M68K_EMULATE_PREFETCH */
 }
+
+#if M68K_PREDECODE
+/* Fetch the instruction at PC from the predecode cache, and make its
+ * extension words available to m68ki_read_imm_xx()
+ */
+static inline const m68ki_decoded *m68ki_fetch_decoded(void)
+{
+	uint pc = ADDRESS_68K(REG_PC);
+	const m68ki_decoded *d = m68ki_predecode_pages[pc >> 12];
+
+	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+
+	if(d == NULL || !(d += (pc & 0xfff) >> 1)->valid)
+		d = m68ki_predecode_miss(pc);
+	REG_IR = d->ir;
+	REG_PC += 2;
+	m68ki_predecode_imm = d->ext;
+	return d;
+}
+#endif /* M68K_PREDECODE */
 #endif /* M68K_RECOMPILER */
 
 /* ------------------------- Top level read/write ------------------------- */
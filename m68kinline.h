@@ -50,6 +50,59 @@ static inline void m68k_write_memory_32(unsigned int address, unsigned int val)
 	*(volatile u_uint32_t* restrict)(address) = val;
 }
 
+#else
+
+#include "platform.h"
+
+// M68K memory handlers on PC host.
+//
+// Memory is mapped with 4 KiB pages (see hw.c): accesses to pages of RAM and
+// ROM are done directly through a host pointer, while the others (I/O
+// registers, and PB-ROM when it is not linearly mapped) are dispatched by
+// hw_mem_read() / hw_mem_write() to the handlers of their bank.
+// 32-bit accesses that straddle two pages also go through hw.c.
+// See MEM_SWAPPED in platform.h for the layout of memory.
+
+typedef uint16_t u_uint16_t __attribute__((aligned(1)));
+typedef uint32_t u_uint32_t __attribute__((aligned(1)));
+
+extern uint8_t *hw_rpages[4096], *hw_wpages[4096];
+unsigned int hw_mem_read(unsigned int address, int sz);
+void hw_mem_write(unsigned int address, unsigned int val, int sz);
+unsigned int hw_vram_data_burst(unsigned int src, unsigned int n);
+
+static inline unsigned int  m68k_read_memory_8(unsigned int address) {
+	uint8_t *p = hw_rpages[(address >> 12) & 0xFFF];
+	if (likely(p)) return p[MEM_BYTE(address & 0xFFF)];
+	return hw_mem_read(address, 1);
+}
+static inline unsigned int  m68k_read_memory_16(unsigned int address) {
+	uint8_t *p = hw_rpages[(address >> 12) & 0xFFF];
+	if (likely(p)) return MEM16(*(u_uint16_t*)(p + (address & 0xFFF)));
+	return hw_mem_read(address, 2);
+}
+static inline unsigned int  m68k_read_memory_32(unsigned int address) {
+	uint8_t *p = hw_rpages[(address >> 12) & 0xFFF];
+	if (likely(p && (address & 0xFFF) != 0xFFE)) return MEM32(*(u_uint32_t*)(p + (address & 0xFFF)));
+	return hw_mem_read(address, 4);
+}
+
+static inline void m68k_write_memory_8(unsigned int address, unsigned int val) {
+	uint8_t *p = hw_wpages[(address >> 12) & 0xFFF];
+	if (likely(p)) { p[MEM_BYTE(address & 0xFFF)] = val; return; }
+	hw_mem_write(address, val, 1);
+}
+static inline void m68k_write_memory_16(unsigned int address, unsigned int val) {
+	uint8_t *p = hw_wpages[(address >> 12) & 0xFFF];
+	if (likely(p)) { *(u_uint16_t*)(p + (address & 0xFFF)) = MEM16(val); return; }
+	hw_mem_write(address, val, 2);
+}
+static inline void m68k_write_memory_32(unsigned int address, unsigned int val) {
+	uint8_t *p = hw_wpages[(address >> 12) & 0xFFF];
+	if (likely(p && (address & 0xFFF) != 0xFFE)) { *(u_uint32_t*)(p + (address & 0xFFF)) = MEM32(val); return; }
+	hw_mem_write(address, val, 4);
+}
+
 #endif
 
 static inline bool m68k_check_idle_skip(unsigned int address) {
@@ -64,6 +64,14 @@
 		} \
 	})
 
+	// Profiling ticks (nanoseconds), with the same API of libdragon timers
+	#define TICKS_PER_SECOND          1000000000u
+	#define TICKS_READ()              plat_ticks()
+	#define TICKS_DISTANCE(from, to)  ((int32_t)((uint32_t)(to) - (uint32_t)(from)))
+	#define TICKS_FROM_MS(ms)         ((ms) * 1000000u)
+
+	uint32_t plat_ticks(void);
+
 	#define PLAT_KEY_P1_UP        SDL_SCANCODE_UP
 	#define PLAT_KEY_P1_DOWN      SDL_SCANCODE_DOWN
 	#define PLAT_KEY_P1_LEFT      SDL_SCANCODE_LEFT
@@ -85,6 +93,30 @@
 
 #endif
 
+// Memory images of the 68k address space (ROM and RAM) can be stored as
+// host-endian 16-bit words (MEM_SWAPPED, the default on little-endian PC
+// hosts), so that 16-bit accesses need no byte swap. Byte accesses must
+// then flip the lowest address bit (MEM_BYTE), and 32-bit accesses
+// exchange the two words (MEM32). Otherwise, images are big-endian as
+// on the 68k. Conversion happens when ROMs are loaded.
+#ifndef MEM_SWAPPED
+	#if !defined(N64) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		#define MEM_SWAPPED  1
+	#else
+		#define MEM_SWAPPED  0
+	#endif
+#endif
+
+#if MEM_SWAPPED
+	#define MEM_BYTE(addr)  ((addr) ^ 1)
+	#define MEM16(x)        (x)
+	#define MEM32(x)        ({ uint32_t __v = (x); (__v << 16) | (__v >> 16); })
+#else
+	#define MEM_BYTE(addr)  (addr)
+	#define MEM16(x)        BE16(x)
+	#define MEM32(x)        BE32(x)
+#endif
+
 extern uint8_t *g_screen_ptr;
 extern int g_screen_pitch;
 
@@ -32,7 +32,9 @@ static void fill_audio(void *userdata, uint8_t* stream, int len);
 
 void plat_init(int audiofreq, int fps)
 {
-    if ( SDL_Init(SDL_INIT_AUDIO|SDL_INIT_VIDEO) < 0 )
+    // Video is initialized on demand by plat_enable_video, so that the
+    // emulator can also run headless (eg: benchmark mode).
+    if ( SDL_Init(SDL_INIT_EVENTS) < 0 )
     {
         printf("Unable to init SDL: %s\n", SDL_GetError());
         exit(1);
@@ -41,10 +43,20 @@ void plat_init(int audiofreq, int fps)
 
     keystate = SDL_GetKeyboardState(NULL);
 
+    // An audio frequency of 0 means that audio is disabled.
+    if (!audiofreq)
+        return;
+
     samples_per_frame = audiofreq / fps;
     fprintf(stderr, "Music set to %d FPS\n", fps);
 
     /* Initialize audio */
+    if ( SDL_InitSubSystem(SDL_INIT_AUDIO) < 0 )
+    {
+        printf("Unable to init SDL audio: %s\n", SDL_GetError());
+        exit(1);
+    }
+
     SDL_AudioSpec wanted;
 
     wanted.freq = audiofreq;
@@ -104,6 +116,12 @@ void plat_enable_video(int enable)
 {
     if (enable && !g_videoenable)
     {
+        if ( SDL_InitSubSystem(SDL_INIT_VIDEO) < 0 )
+        {
+            printf("Unable to init SDL video: %s\n", SDL_GetError());
+            exit(1);
+        }
+
         screen = SDL_CreateWindow("MVS64 - NeoGeo Emulator",
             SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
             WINDOW_WIDTH, WINDOW_WIDTH*3/4, SDL_WINDOW_RESIZABLE);
@@ -167,6 +185,13 @@ void plat_endframe(void)
     g_screen_pitch = 0;
 }
 
+uint32_t plat_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000000u + (uint32_t)ts.tv_nsec;
+}
+
 void plat_save_screenshot(const char *fn)
 {
     SDL_Surface* saveSurface = SDL_CreateRGBSurfaceFrom(
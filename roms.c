@@ -27,6 +27,7 @@ extern uint32_t profile_dma_load;
 
 static SpriteCache srom_cache;
 static SpriteCache crom_cache;
+static SpriteCache crom_decoded_cache;
 
 static const char* srom_fn[2] = {NULL, NULL};
 static const char* crom_fn[1] = {NULL};
@@ -49,6 +50,13 @@ static unsigned int srom_num_tiles;
 static void rom_cache_init(void) {
 	sprite_cache_init(&srom_cache, 4*8, 256);
 	sprite_cache_init(&crom_cache, 8*16, 1280);
+	// Decoded tiles are only used by the CPU renderer, which is not the default
+	// one on N64 (see video.c): there, keep just as many as the 4bpp cache.
+	#ifdef N64
+	sprite_cache_init(&crom_decoded_cache, sizeof(SpriteDecoded), 1280);
+	#else
+	sprite_cache_init(&crom_decoded_cache, sizeof(SpriteDecoded), 4096);
+	#endif
 }
 
 uint8_t* srom_get_sprite(int spritenum) {
@@ -59,16 +67,16 @@ uint8_t* srom_get_sprite(int spritenum) {
 	pix = sprite_cache_insert(&srom_cache, spritenum);
 	assertf(pix, "SROM cache is full");
 
-	#ifdef N64
 	profile_dma_load -= TICKS_READ();
+	#ifdef N64
 	dfs_seek(srom_file, spritenum*4*8, SEEK_SET);
 	dfs_read(pix, 1, 4*8, srom_file);
 	data_cache_hit_writeback_invalidate(pix, 4*8);    // FIXME: should not be required
-	profile_dma_load += TICKS_READ();
 	#else
 	fseek(srom_file, spritenum*4*8, SEEK_SET);
 	fread(pix, 1, 4*8, srom_file);
 	#endif
+	profile_dma_load += TICKS_READ();
 
 	return pix;
 }
@@ -83,20 +91,35 @@ uint8_t* crom_get_sprite(int spritenum) {
 	pix = sprite_cache_insert(&crom_cache, spritenum);
 	assertf(pix, "CROM cache is full");
 
-	#ifdef N64
 	profile_dma_load -= TICKS_READ();
+	#ifdef N64
 	dfs_seek(crom_file, spritenum*8*16, SEEK_SET);
 	dfs_read(pix, 1, 8*16, crom_file);
 	data_cache_hit_writeback_invalidate(pix, 8*16);  // FIXME: should not be required
-	profile_dma_load += TICKS_READ();
 	#else
 	fseek(crom_file, spritenum*8*16, SEEK_SET);
 	fread(pix, 1, 8*16, crom_file);
 	#endif
+	profile_dma_load += TICKS_READ();
 
 	return pix;
 }
 
+// Same as crom_get_sprite, but return the tile decoded to 8bpp. Decoded tiles
+// are cached separately, so they are decoded only on first use.
+SpriteDecoded* crom_get_sprite_decoded(int spritenum) {
+	spritenum &= crom_mask;
+	if (spritenum >= crom_num_tiles) spritenum = crom_num_tiles-1;
+
+	SpriteDecoded *d = (SpriteDecoded*)sprite_cache_lookup(&crom_decoded_cache, spritenum);
+	if (d) return d;
+
+	d = (SpriteDecoded*)sprite_cache_insert(&crom_decoded_cache, spritenum);
+	assertf(d, "CROM decoded cache is full");
+	sprite_decode(d, crom_get_sprite(spritenum));
+	return d;
+}
+
 void srom_set_bank(int bank) {
 	assert(bank == 0 || bank == 1);
 	unsigned len;
@@ -140,6 +163,7 @@ void crom_set_bank(int bank) {
 	#endif
 
 	sprite_cache_reset(&crom_cache);
+	sprite_cache_reset(&crom_decoded_cache);
 	crom_num_tiles = len / (8*16);
 
 	// Calculate mask based on next power of two
@@ -208,6 +232,15 @@ static bool pbrom_is_linear = false;
 uint32_t pbrom_last_bank = 0xFFFFFFFF;
 uint8_t *pbrom_last_mem = NULL;
 
+// Swap the bytes of each 16-bit word
+static void mem_swap16(uint8_t *buf, int sz) {
+	for (int i=0;i<sz;i+=2) {
+		uint8_t v = buf[i];
+		buf[i] = buf[i+1];
+		buf[i+1] = v;
+	}
+}
+
 void pbrom_init(const char *fn) {
 	unsigned len;
 	#ifdef N64
@@ -260,6 +293,7 @@ void pbrom_init(const char *fn) {
 	fread(PB_ROM, 1, len, pbrom_file);
 	fclose(pbrom_file); pbrom_file = NULL;
 	#endif
+	if (MEM_SWAPPED) mem_swap16(PB_ROM, len);
 	pbrom_is_linear = true;
 	debugf("[PBROM] using linear mode\n");
 }
@@ -330,6 +364,7 @@ uint8_t *pbrom_cache_lookup(uint32_t address) {
 	fseek(pbrom_file, base, SEEK_SET);
 	fread(mem, 1, (1<<PBROM_BANK_BITS)+2, pbrom_file);
 	#endif
+	if (MEM_SWAPPED) mem_swap16(mem, (1<<PBROM_BANK_BITS)+2);
 
 	pbrom_last_mem = mem;
 	pbrom_last_bank = bank;
@@ -354,13 +389,8 @@ static void rom(const char *dir, const char* name, int off, int sz, uint8_t *buf
 	fclose(f);
 	assertf(read == sz, "rom:%s off:%d sz:%d read:%d", fullname, off, sz, read);
 
-	if (bswap) {
-		for (int i=0;i<sz;i+=2) {
-			uint8_t v = buf[i];
-			buf[i] = buf[i+1];
-			buf[i+1] = v;
-		}
-	}
+	if (bswap)
+		mem_swap16(buf, sz);
 }
 
 #define strcatalloc(a, b) ({ char v[strlen(a)+strlen(b)+1]; strcpy(v, a); strcat(v, b); strdup(v); })
@@ -382,17 +412,18 @@ static uint32_t ini_get_integer(const char *ini, const char *key, bool *ok) {
 void rom_next_frame(void) {
 	sprite_cache_tick(&srom_cache);
 	sprite_cache_tick(&crom_cache);
+	sprite_cache_tick(&crom_decoded_cache);
 }
 
 void rom_load_prom(const char *dir) {
 	if (!P_ROM) P_ROM = memalign(256*1024, 1024*1024);
 	assertf(P_ROM, "cannot allocate P_ROM buffer");
-	rom(dir, "p.rom", 0, 0, P_ROM, P_ROM_SIZE, false);
+	rom(dir, "p.rom", 0, 0, P_ROM, P_ROM_SIZE, MEM_SWAPPED);
 }
 
 void rom_load(const char *dir) {
 	rom_load_prom(dir);
-	rom(dir, "p.bios", 0, 0, BIOS, sizeof(BIOS), false);
+	rom(dir, "p.bios", 0, 0, BIOS, sizeof(BIOS), MEM_SWAPPED);
 
 	char ini[1024];
 	strcpy(ini, dir);
@@ -1,6 +1,8 @@
 #ifndef ROMS_H
 #define ROMS_H
 
+#include "sprite_cache.h"
+
 extern uint8_t *P_ROM;
 extern unsigned int rom_pc_idle_skip;
 
@@ -8,6 +10,7 @@ void rom_load(const char *dir);
 void rom_load_prom(const char *dir);
 
 uint8_t* crom_get_sprite(int spritenum);
+SpriteDecoded* crom_get_sprite_decoded(int spritenum);
 uint8_t* srom_get_sprite(int spritenum);
 
 void srom_set_bank(int bank);  // 0 = fixed (BIOS), 1 = game
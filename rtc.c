@@ -40,10 +40,18 @@ static void rtc_stb_w(uint8_t x) {
 	}
 }
 
+// REG_POUTPUT/RTC control (0x380051)
+static void rtc_ctrl_w(uint32_t addr, uint32_t val, int sz) {
+	rtc_data_w(val&1);
+	rtc_clock_w(val&2);
+	rtc_stb_w(val&4);
+}
+
 static uint8_t rtc_data_r(void) { return 1; }
 static uint8_t rtc_tp_r(void) { return reg_rtc_tp; }
 
 static void rtc_init_(void) {
 	rtc_event_period = MVS_CLOCK;
 	rtc_event_id = emu_add_event(rtc_event_period/2, rtc_event_cb, NULL);
+	mmio_register(0x380051, 1, NULL, rtc_ctrl_w);
 }
@@ -39,7 +39,7 @@ void sprite_cache_init(SpriteCache *c, int sprite_size, int max_sprites) {
 	c->sprites = memalign(16, sprite_size * max_sprites);
 	assertf(c->sprites, "memory allocation failed");
 
-	c->free_sprite_indices = malloc(sizeof(uint16_t) * max_sprites);
+	c->free_sprite_indices = malloc(sizeof(uint32_t) * max_sprites);
 	assertf(c->free_sprite_indices, "memory allocation failed");
 
 	// Compute number of buckets as next-next power of two of the maximum number of
@@ -190,4 +190,28 @@ void sprite_cache_pop(SpriteCache *c) {
 		bidx = (bidx + 1) & (c->num_buckets-1);
 	}
 	LOG("[CACHE] pop end %d\n", c->num_sprites);
-}
\ No newline at end of file
+}
+
+// Decode a 16x16 4bpp tile (8 bytes per row, high nibble first) into one
+// color index per byte, and compute its transparency masks and flags.
+void sprite_decode(SpriteDecoded *d, const uint8_t *src) {
+	bool opaque = true, transparent = true;
+
+	for (int y=0;y<16;y++) {
+		uint16_t mask = 0;
+		for (int x=0;x<16;x+=2) {
+			uint8_t px0 = src[x/2] >> 4, px1 = src[x/2] & 0xF;
+			d->pix[y][x+0] = px0;
+			d->pix[y][x+1] = px1;
+			mask |= ((px0 != 0) << x) | ((px1 != 0) << (x+1));
+		}
+		d->opaque[y] = mask;
+		if (mask != 0xFFFF) opaque = false;
+		if (mask != 0) transparent = false;
+		src += 8;
+	}
+
+	d->flags = 0;
+	if (opaque) d->flags |= SPRITE_DECODED_OPAQUE;
+	if (transparent) d->flags |= SPRITE_DECODED_TRANSPARENT;
+}
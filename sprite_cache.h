@@ -2,6 +2,7 @@
 #define SPRITE_CACHE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct SpriteCacheEntry_s SpriteCacheEntry;
 
@@ -13,7 +14,7 @@ typedef struct {
 	int32_t cur_tick;               // current tick (frame counter)
 	int32_t tick_cutoff;            // tick which marks sprites old enough to remove with sprite_cache_pop                 
 	uint8_t *sprites;               // pixel memory (for all sprites)
-	uint16_t *free_sprite_indices;
+	uint32_t *free_sprite_indices;
 	int num_sprites;				// number of sprites currently in cache
 	SpriteCacheEntry *buckets;      // hashtable of the sprite entries
 } SpriteCache;
@@ -25,4 +26,21 @@ uint8_t* sprite_cache_lookup(SpriteCache *c, uint32_t key);
 uint8_t* sprite_cache_insert(SpriteCache *c, uint32_t key);
 void sprite_cache_pop(SpriteCache *c);
 
+// A 16x16 tile decoded to one color index per byte. Renderers that draw with
+// the CPU keep these in a second cache tier, on top of the 4bpp tiles, so
+// that pixels are unpacked only once rather than every time they are drawn.
+typedef struct {
+	uint8_t pix[16][16];            // color indices (0 = transparent)
+	uint16_t opaque[16];            // for each row, bitmask of non-transparent pixels (bit N = pixel N)
+	uint8_t flags;                  // SPRITE_DECODED_OPAQUE / SPRITE_DECODED_TRANSPARENT
+	uint8_t padding[7];
+} SpriteDecoded;
+
+_Static_assert(sizeof(SpriteDecoded) % 8 == 0, "sprite cache entries must be a multiple of 8 bytes (see SPRITE_FREEIDX_SCALE)");
+
+#define SPRITE_DECODED_OPAQUE       1   // all pixels are non-transparent
+#define SPRITE_DECODED_TRANSPARENT  2   // all pixels are transparent
+
+void sprite_decode(SpriteDecoded *d, const uint8_t *src);
+
 #endif /* SPRITE_CACHE_H */
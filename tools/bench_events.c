@@ -0,0 +1,147 @@
+// Microbenchmark for the emulator event scheduler.
+//
+// This compares the binary heap in event_queue.c with the linear-scan event
+// array that emu.c used before, on a workload that mimics a frame with a
+// scanline timer (264 events per frame), plus the usual render, vblank, RTC
+// and watchdog events. Additional idle events (with long periods, like sound
+// chip timers) are added to show how dispatch cost scales with the number of
+// pending events.
+//
+// Build and run from the repository root:
+//
+//     cc -O2 -I. tools/bench_events.c event_queue.c -o bench_events
+//     ./bench_events
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "event_queue.h"
+
+#define MVS_CLOCK         24000000
+#define FPS               60
+#define FRAME_CLOCK       (MVS_CLOCK / FPS)
+#define LINE_CLOCK        (FRAME_CLOCK / 264)
+#define WATCHDOG_PERIOD   3244030
+
+#define NUM_FRAMES        20000
+#define MAX_LINEAR_EVENTS 256
+
+static uint64_t checksum;
+
+static uint32_t ev_line(void *arg)     { checksum = checksum*31 + 1; return LINE_CLOCK; }
+static uint32_t ev_frame(void *arg)    { checksum = checksum*31 + 2; return FRAME_CLOCK; }
+static uint32_t ev_rtc(void *arg)      { checksum = checksum*31 + 3; return MVS_CLOCK/2; }
+static uint32_t ev_watchdog(void *arg) { checksum = checksum*31 + 4; return WATCHDOG_PERIOD; }
+static uint32_t ev_idle(void *arg)     { checksum = checksum*31 + (uintptr_t)arg; return FRAME_CLOCK*7 + (uintptr_t)arg; }
+
+// Linear-scan event array (the original emu.c implementation)
+static EmuEvent linear[MAX_LINEAR_EVENTS];
+static int linear_size;
+
+static EmuEvent* linear_next(void) {
+	EmuEvent *e = NULL;
+	for (int i=0;i<linear_size;i++) {
+		if (!linear[i].cb) continue;
+		if (!e || linear[i].clock < e->clock) e=&linear[i];
+	}
+	return e;
+}
+
+static int linear_add(int64_t clock, EmuEventCb cb, void *cbarg) {
+	for (int i=0;i<linear_size;i++) {
+		if (linear[i].cb) continue;
+		linear[i] = (EmuEvent){ .clock = clock, .cb = cb, .cbarg = cbarg };
+		return i;
+	}
+	abort();
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void setup(int nevents, int (*add)(int64_t, EmuEventCb, void*)) {
+	add(LINE_CLOCK, ev_line, NULL);
+	add(LINE_CLOCK*24, ev_frame, NULL);
+	add(LINE_CLOCK*248, ev_frame, NULL);
+	add(MVS_CLOCK/2, ev_rtc, NULL);
+	add(WATCHDOG_PERIOD, ev_watchdog, NULL);
+	for (int i=5;i<nevents;i++)
+		add(FRAME_CLOCK*3 + i*LINE_CLOCK, ev_idle, (void*)(uintptr_t)i);
+}
+
+static double bench_linear(int nevents, uint64_t *dispatched) {
+	memset(linear, 0, sizeof(linear));
+	linear_size = nevents < 8 ? 8 : nevents;
+	setup(nevents, linear_add);
+
+	checksum = 0; *dispatched = 0;
+	double t0 = now();
+	for (int f=0;f<NUM_FRAMES;f++) {
+		int64_t vsync = (int64_t)(f+1) * FRAME_CLOCK;
+		EmuEvent *e;
+		while ((e = linear_next()) && e->clock < vsync) {
+			uint32_t repeat = e->cb(e->cbarg);
+			if (repeat) e->clock += repeat;
+			else e->cb = NULL;
+			(*dispatched)++;
+		}
+	}
+	return now() - t0;
+}
+
+static EventQueue *heapq;
+static int heap_add(int64_t clock, EmuEventCb cb, void *cbarg) {
+	return event_queue_add(heapq, clock, cb, cbarg);
+}
+
+static double bench_heap(int nevents, uint64_t *dispatched) {
+	EventQueue q;
+	event_queue_init(&q, 8);
+	heapq = &q;
+	setup(nevents, heap_add);
+
+	checksum = 0; *dispatched = 0;
+	double t0 = now();
+	for (int f=0;f<NUM_FRAMES;f++) {
+		int64_t vsync = (int64_t)(f+1) * FRAME_CLOCK;
+		int id;
+		while ((id = event_queue_peek(&q)) >= 0 && event_queue_get(&q, id)->clock < vsync) {
+			EmuEvent *e = event_queue_get(&q, id);
+			uint32_t repeat = e->cb(e->cbarg);
+			e = event_queue_get(&q, id);
+			if (repeat) event_queue_change(&q, id, e->clock + repeat);
+			else event_queue_remove(&q, id);
+			(*dispatched)++;
+		}
+	}
+	double t = now() - t0;
+	event_queue_free(&q);
+	return t;
+}
+
+int main(int argc, char *argv[]) {
+	static const int sizes[] = { 5, 8, 16, 32, 64, 128, 256 };
+
+	printf("%d frames, %d scanline events per frame\n\n", NUM_FRAMES, FRAME_CLOCK / LINE_CLOCK);
+	printf("%8s %12s %12s %12s %8s\n", "events", "dispatches", "linear ns", "heap ns", "speedup");
+	for (int i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+		uint64_t nl, nh;
+		double tl = bench_linear(sizes[i], &nl);
+		uint64_t cl = checksum;
+		double th = bench_heap(sizes[i], &nh);
+		uint64_t ch = checksum;
+
+		if (nl != nh || cl != ch) {
+			fprintf(stderr, "mismatch: dispatch sequence differs with %d events\n", sizes[i]);
+			return 1;
+		}
+
+		printf("%8d %12llu %12.1f %12.1f %7.2fx\n", sizes[i], (unsigned long long)nl,
+			tl * 1e9 / nl, th * 1e9 / nh, tl / th);
+	}
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
 #include "video.h"
 #include "roms.h"
 #include "hw.h"
@@ -46,7 +47,51 @@ static uint16_t color_convert(uint16_t val) {
 	return c16;
 }
 
-static uint16_t PALETTE_RAM_EMU[4*1024];
+// PALETTE_RAM converted to the host format (both banks). Each backend
+// converts in render_begin() the palettes that were changed since the last
+// frame, so that switching bank just selects the other half.
+static uint16_t PALETTE_RAM_EMU[8*1024];
+
+// Current bank in PALETTE_RAM_EMU
+static uint16_t *palette_emu;
+
+// Video state read by the renderer. This is normally the live hardware state,
+// but a copy of it taken by video_snapshot() can also be rendered, while the
+// emulation goes on changing the hardware (see --pipeline in emu.c).
+typedef struct {
+	uint16_t *vram;        // VIDEO_RAM
+	uint8_t *vram_dirty;   // VIDEO_RAM_DIRTY
+	uint16_t *pal;         // PALETTE_RAM (both banks)
+	uint8_t *pal_dirty;    // PALETTE_RAM_DIRTY
+	int pal_bank;          // PALETTE_RAM_BANK
+	int fix_bank;          // FIX_ROM_BANK
+	bool aa_enabled;       // see lspc_get_auto_animation()
+	uint8_t aa;
+} VideoState;
+
+static VideoState video_live = { VIDEO_RAM, VIDEO_RAM_DIRTY, PALETTE_RAM, PALETTE_RAM_DIRTY };
+
+// State being rendered
+static VideoState *vs = &video_live;
+
+// Check if a range of VIDEO_RAM changed in the rendered state since the last frame
+static bool video_dirty_range(int start, int n);
+
+// A sprite tile to draw, as decoded from the SCBs by decode_sprites(). The
+// whole frame is decoded into a list of these, which is then drawn in bulk
+// by the backend with draw_sprite_list().
+typedef struct {
+	uint32_t tile;      // tile number (auto-animation already applied)
+	uint8_t pal;        // palette number
+	uint8_t flags;      // SPRITE_FLIPX / SPRITE_FLIPY
+	int16_t x, y;       // position (not wrapped to 512)
+	uint8_t w, h;       // size in pixels, after shrinking (1-16)
+} SpriteCmd;
+
+_Static_assert(sizeof(SpriteCmd) == 12, "SpriteCmd must be packed");
+
+#define SPRITE_FLIPX   1
+#define SPRITE_FLIPY   2
 
 #ifdef N64
 	#if 1
@@ -59,7 +104,7 @@ static uint16_t PALETTE_RAM_EMU[4*1024];
 #endif
 
 static void render_fix(void) {
-	uint16_t *fix = VIDEO_RAM + 0x7000;
+	const uint16_t *fix = vs->vram + 0x7000;
 
 	render_begin_fix();
 
@@ -67,8 +112,15 @@ static void render_fix(void) {
 		fix += 2; // skip two lines
 		for (int j=0;j<28;j++) {
 			uint16_t v = *fix++;
-			if (v)
-				draw_sprite_fix(v & 0xFFF, (v >> 12) & 0xF, i*8, j*8);
+			#if FIX_RETAINED
+			// The backend keeps the fix layer across frames, so only
+			// the cells that changed must be redrawn (or cleared).
+			if (!vs->vram_dirty[fix-1 - vs->vram]) continue;
+			if (!v) { clear_sprite_fix(i*8, j*8); continue; }
+			#else
+			if (!v) continue;
+			#endif
+			draw_sprite_fix(v & 0xFFF, (v >> 12) & 0xF, i*8, j*8);
 		}
 		fix += 2;
 	}
@@ -77,138 +129,294 @@ static void render_fix(void) {
 }
 
 
-static void render_sprites(void) {
-	int sx = 0, sy = 0, sh = 0, sw = 0, vshrink = 0;
-	bool repeat_tiles = false;
+// Draw list of the last decoded frame
+static SpriteCmd *sprite_list;
+static int sprite_list_len, sprite_list_cap;
+static bool sprite_list_valid;
+static bool sprite_list_aa_enabled;
+static uint8_t sprite_list_aa;
 
-	uint8_t aa;
-	bool aa_enabled = lspc_get_auto_animation(&aa);
+static void sprite_list_push(uint32_t tile, int pal, int x, int y, int w, int h, bool flipx, bool flipy) {
+	if (sprite_list_len == sprite_list_cap) {
+		sprite_list_cap = sprite_list_cap ? sprite_list_cap*2 : 4096;
+		sprite_list = realloc(sprite_list, sprite_list_cap * sizeof(SpriteCmd));
+		assertf(sprite_list, "cannot allocate sprite list");
+	}
+	sprite_list[sprite_list_len++] = (SpriteCmd){
+		.tile = tile, .pal = pal, .x = x, .y = y, .w = w, .h = h,
+		.flags = (flipx ? SPRITE_FLIPX : 0) | (flipy ? SPRITE_FLIPY : 0),
+	};
+}
 
-	render_begin_sprites();
+// A chain of sprites: a sprite, followed by the ones that are sticky to it.
+// They share the vertical position, size and shrinking of the first one,
+// and are placed one after the other horizontally.
+typedef struct {
+	int16_t snum, count;    // first sprite, and number of sprites
+	int16_t x, y;           // position of the first sprite
+	int16_t h;              // height in pixels
+	uint8_t vshrink;        // vertical shrinking
+	bool repeat;            // repeat tiles (height was more than 32 tiles)
+} SpriteGroup;
+
+// Groups that can be visible, as found by cull_sprites()
+static SpriteGroup sprite_groups[381];
+static int sprite_groups_len;
+static bool sprite_groups_valid;
+
+// Check if a group can have pixels within the 320x224 window, given the
+// X coordinate at its right end. Each tile drawn by decode_sprites() lies
+// within [y, y+h), and each sprite within [x, x1), so a group is invisible
+// when no tile or sprite can pass their visibility checks.
+static bool sprite_group_visible(const SpriteGroup *g, int x1) {
+	if (g->h == 0) return false;
+	if (g->y >= 224 && g->y + g->h <= 512) return false;
+	if (g->x >= 320 && x1 <= 512) return false;
+	return true;
+}
+
+// Resolve the sprite chains from SCB2/3/4, keeping only the groups that can
+// be visible. Sticky sprites before the first non-sticky one have no height,
+// so they are never drawn.
+static void cull_sprites(void) {
+	SpriteGroup *g = NULL;
+	int x1 = 0;
 
+	sprite_groups_len = 0;
 	for (int snum=0;snum<381;snum++) {
-		uint16_t zc = VIDEO_RAM[0x8000 + snum];
-		uint16_t yc = VIDEO_RAM[0x8200 + snum];
-		uint16_t xc = VIDEO_RAM[0x8400 + snum];
-		uint16_t *tmap = VIDEO_RAM + snum*64;
+		uint16_t zc = vs->vram[0x8000 + snum];
+		uint16_t yc = vs->vram[0x8200 + snum];
+		uint16_t xc = vs->vram[0x8400 + snum];
 
 		if (!(yc & 0x40)) {
-			sx = xc >> 7;
-			sy = 496 - (yc >> 7);
-			sh = (yc & 0x3F) * 16;
-			repeat_tiles = false;
-			if (sh > 32*16) { sh = 32*16; repeat_tiles = true; };
-			vshrink = zc & 0xFF;
-		} else {
-			sx += sw;
+			if (g && sprite_group_visible(g, x1))
+				sprite_groups_len++;
+			g = &sprite_groups[sprite_groups_len];
+			g->snum = snum;
+			g->count = 0;
+			g->x = xc >> 7;
+			g->y = 496 - (yc >> 7);
+			g->h = (yc & 0x3F) * 16;
+			g->repeat = false;
+			if (g->h > 32*16) { g->h = 32*16; g->repeat = true; };
+			g->vshrink = zc & 0xFF;
+			x1 = g->x;
 		}
+		if (!g) continue;
+
+		g->count++;
+		x1 += ((zc>>8)&0xF) + 1;
+	}
+	if (g && sprite_group_visible(g, x1))
+		sprite_groups_len++;
+}
+
+// Decode the SCBs of the visible groups into the draw list
+static void decode_sprites(bool aa_enabled, uint8_t aa) {
+	sprite_list_len = 0;
+
+	for (int gi=0;gi<sprite_groups_len;gi++) {
+		const SpriteGroup *g = &sprite_groups[gi];
+		int sx = g->x, sy = g->y, sh = g->h, sw = 0, vshrink = g->vshrink;
+		bool repeat_tiles = g->repeat;
+
+		for (int snum=g->snum;snum<g->snum+g->count;snum++) {
+			uint16_t zc = vs->vram[0x8000 + snum];
+			const uint16_t *tmap = vs->vram + snum*64;
 
-		sw = ((zc>>8)&0xF) + 1;
-
-		if (sh == 0) continue;
-		if (sx >= 320 && sx+sw <= 512) continue;
-
-		// debugf("[VIDEO] sprite snum:%d xc:%04x yc:%04x zc:%04x pos:%d,%d sh:%d chain:%d repeat:%d tmap:%04x:%04x\n", snum, xc, yc, zc, sx, sy, sh, (yc & 0x40), repeat_tiles, tmap[0], tmap[1]);
-
-		int nt, y, maxy;
-		int halfy = sh < 256 ? sh : 256;
-
-		// Iterate on the two halves of the vertical sprite. This for loop
-		// is mainly useful to reuse the core drawing loop. The setup
-		// of the two halves is different (see below).
-		for (int half = 0; half < 2; half++) {
-			if (half == 0) {
-				// Top half of the sprite (first 256 pixels). This part shrinks
-				// to the top of the sprite position. In case of overfill, this
-				// is exactly 256 pixels, repeating all tiles as required.
-				maxy = halfy;
-				nt = y = 0;
-			} else {
-				if (sh <= 256) break;
-
-				// Bottom half of the sprite (pixels after 256). This part shrinks
-				// to the bottom of the sprite (because it accesses the line ROM
-				// backward, reversing also its contents).
-				maxy = sh;
-				if (repeat_tiles) {
-					// In repeat mode, we need to find a starting Y where the next
-					// tile begins, which is basically symmetric across the 256 pixel
-					// line compared to where we ended up with the top half.
-					// FIXME: overdraw here, we should instead clip.
-					y -= (y-256)*2;
-					nt = (32-nt)&31;
+			// Sticky sprites are placed right after the previous one
+			sx += sw;
+			sw = ((zc>>8)&0xF) + 1;
+
+			if (sx >= 320 && sx+sw <= 512) continue;
+
+			// debugf("[VIDEO] sprite snum:%d zc:%04x pos:%d,%d sh:%d chain:%d repeat:%d tmap:%04x:%04x\n", snum, zc, sx, sy, sh, snum != g->snum, repeat_tiles, tmap[0], tmap[1]);
+
+			int nt, y, maxy;
+			int halfy = sh < 256 ? sh : 256;
+
+			// Iterate on the two halves of the vertical sprite. This for loop
+			// is mainly useful to reuse the core drawing loop. The setup
+			// of the two halves is different (see below).
+			for (int half = 0; half < 2; half++) {
+				if (half == 0) {
+					// Top half of the sprite (first 256 pixels). This part shrinks
+					// to the top of the sprite position. In case of overfill, this
+					// is exactly 256 pixels, repeating all tiles as required.
+					maxy = halfy;
+					nt = y = 0;
 				} else {
-					// In non-repeat mode, skip overfill area. We basically want
-					// to reach the symmetric y coordinate in the bottom area.
-					// FIXME: the top half overfill area should be filled with
-					// the last line of tile #15, while the bottom half overfill
-					// should be filled with the first line of tile #16. This
-					// is currently not implemented.
-					y = 32*16 - y;
+					if (sh <= 256) break;
+
+					// Bottom half of the sprite (pixels after 256). This part shrinks
+					// to the bottom of the sprite (because it accesses the line ROM
+					// backward, reversing also its contents).
+					maxy = sh;
+					if (repeat_tiles) {
+						// In repeat mode, we need to find a starting Y where the next
+						// tile begins, which is basically symmetric across the 256 pixel
+						// line compared to where we ended up with the top half.
+						// FIXME: overdraw here, we should instead clip.
+						y -= (y-256)*2;
+						nt = (32-nt)&31;
+					} else {
+						// In non-repeat mode, skip overfill area. We basically want
+						// to reach the symmetric y coordinate in the bottom area.
+						// FIXME: the top half overfill area should be filled with
+						// the last line of tile #15, while the bottom half overfill
+						// should be filled with the first line of tile #16. This
+						// is currently not implemented.
+						y = 32*16 - y;
+					}
 				}
-			}
 
-			// Loop through the vertical sprite, tile by tile
-			while (y < maxy) {
-				// Calculate the vertical size of this tile. This is
-				// a pixel-perfect formula using the magic table derived
-				// from the original NeoGeo L0 ROM.
-				// int ssh = vshrink/16 + (vshrink%16 > VSHRINK_MAGIC[nt]);
-				int ssh = vshrink_tile_height(vshrink, nt);
-
-				if (ssh > 0) {
-					// vertical clip of the tile to the total sprite height
-					// FIXME: this is wrong because ssh also affects the
-					// shrinking size of the sprite. We should separate the
-					// two matters.
-					if (y + ssh > sh)
-						ssh = sh - y;
-
-					// See if this tile is visible, given its Y coordinate and size
-					int ssy = sy + y;
-					if (ssy < 224 || (ssy+ssh) > 512) {
-						uint32_t tnum = tmap[nt*2+0];
-						uint32_t tc = tmap[nt*2+1];
-
-						tnum |= (tc << 12) & 0xF0000;
-						int palnum = ((tc >> 8) & 0xFF);
-
-						// debugf("[VIDEO]   %s: nt:%d y:%d ssy:%d ssh:%d tnum:%x\n", half?"bot":"top", nt, y, ssy, ssh, tnum);
-
-						// Auto animation
-						if (aa_enabled) {
-							if (tc & 8)      { tnum &= ~7; tnum |= aa & 7; }
-							else if (tc & 4) { tnum &= ~3; tnum |= aa & 3; }
+				// Loop through the vertical sprite, tile by tile
+				while (y < maxy) {
+					// Calculate the vertical size of this tile. This is
+					// a pixel-perfect formula using the magic table derived
+					// from the original NeoGeo L0 ROM.
+					// int ssh = vshrink/16 + (vshrink%16 > VSHRINK_MAGIC[nt]);
+					int ssh = vshrink_tile_height(vshrink, nt);
+
+					if (ssh > 0) {
+						// vertical clip of the tile to the total sprite height
+						// FIXME: this is wrong because ssh also affects the
+						// shrinking size of the sprite. We should separate the
+						// two matters.
+						if (y + ssh > sh)
+							ssh = sh - y;
+
+						// See if this tile is visible, given its Y coordinate and size
+						int ssy = sy + y;
+						if (ssy < 224 || (ssy+ssh) > 512) {
+							uint32_t tnum = tmap[nt*2+0];
+							uint32_t tc = tmap[nt*2+1];
+
+							tnum |= (tc << 12) & 0xF0000;
+							int palnum = ((tc >> 8) & 0xFF);
+
+							// debugf("[VIDEO]   %s: nt:%d y:%d ssy:%d ssh:%d tnum:%x\n", half?"bot":"top", nt, y, ssy, ssh, tnum);
+
+							// Auto animation
+							if (aa_enabled) {
+								if (tc & 8)      { tnum &= ~7; tnum |= aa & 7; }
+								else if (tc & 4) { tnum &= ~3; tnum |= aa & 3; }
+							}
+
+							// Queue the tile
+							sprite_list_push(tnum, palnum, sx, ssy, sw, ssh, tc&1, tc&2);
 						}
-
-						// Draw the tile
-						draw_sprite(tnum, palnum, sx, ssy, sw, ssh, tc&1, tc&2);
 					}
-				}
 
-				y += ssh;
-				nt++; nt &= 31;
+					y += ssh;
+					nt++; nt &= 31;
 
-				// In non-repeat mode (standard), the top half
-				// finishes when/if we reach tile #16 (or before, if
-				// the vertical sprite size is reached).
-				if (!repeat_tiles && nt == 16) break;  // FIXME: draw overfill when not repeating
+					// In non-repeat mode (standard), the top half
+					// finishes when/if we reach tile #16 (or before, if
+					// the vertical sprite size is reached).
+					if (!repeat_tiles && nt == 16) break;  // FIXME: draw overfill when not repeating
+				}
 			}
 		}
 	}
+}
+
+static void render_sprites(void) {
+	bool aa_enabled = vs->aa_enabled;
+	uint8_t aa = vs->aa;
+
+	// The visible groups only depend on SCB2/3/4
+	bool scb234_dirty = video_dirty_range(0x8000, 0x600);
+	if (!sprite_groups_valid || scb234_dirty) {
+		cull_sprites();
+		sprite_groups_valid = true;
+		sprite_list_valid = false;
+	}
+
+	// The draw list of the previous frame can be reused if the SCBs and
+	// the auto-animation state did not change.
+	if (!sprite_list_valid || aa_enabled != sprite_list_aa_enabled ||
+		(aa_enabled && aa != sprite_list_aa) || video_dirty_range(0, 381*64)) {
+		decode_sprites(aa_enabled, aa);
+		sprite_list_valid = true;
+		sprite_list_aa_enabled = aa_enabled;
+		sprite_list_aa = aa;
+	}
 
+	render_begin_sprites();
+	draw_sprite_list(sprite_list, sprite_list_len);
 	render_end_sprites();
 }
 
 
 
-void video_render(void) {
+// Mark all of VIDEO_RAM and PALETTE_RAM as changed (or unchanged)
+void video_dirty_reset(bool dirty) {
+	memset(VIDEO_RAM_DIRTY, dirty, sizeof(VIDEO_RAM_DIRTY));
+	memset(PALETTE_RAM_DIRTY, dirty, sizeof(PALETTE_RAM_DIRTY));
+}
+
+// Check if any word in VIDEO_RAM[start, start+n) of the rendered state
+// changed. Both start and n must be multiples of 8.
+static bool video_dirty_range(int start, int n) {
+	uint64_t any = 0;
+	for (int i=start; i<start+n; i+=8) {
+		uint64_t d; memcpy(&d, vs->vram_dirty + i, 8);
+		any |= d;
+	}
+	return any != 0;
+}
+
+// Latch the registers that affect rendering into a video state
+static void video_state_latch(VideoState *s) {
+	s->pal_bank = PALETTE_RAM_BANK;
+	s->fix_bank = FIX_ROM_BANK;
+	s->aa_enabled = lspc_get_auto_animation(&s->aa);
+}
+
+static void video_render_state(VideoState *s) {
+	vs = s;
+	srom_set_bank(s->fix_bank);
+	palette_emu = PALETTE_RAM_EMU + s->pal_bank;
 	render_begin();
 	render_sprites();
 	render_fix();
 	render_end();
+	memset(s->vram_dirty, 0, sizeof(VIDEO_RAM_DIRTY));
+	memset(s->pal_dirty, 0, sizeof(PALETTE_RAM_DIRTY));
 }
 
+void video_render(void) {
+	video_state_latch(&video_live);
+	video_render_state(&video_live);
+}
+
+#ifndef N64
+static uint16_t snap_vram[34*1024];
+static uint8_t snap_vram_dirty[34*1024];
+static uint16_t snap_pal[8*1024];
+static uint8_t snap_pal_dirty[8*1024/16];
+static VideoState video_snap = { snap_vram, snap_vram_dirty, snap_pal, snap_pal_dirty };
+
+_Static_assert(sizeof(snap_vram) == sizeof(VIDEO_RAM) && sizeof(snap_pal) == sizeof(PALETTE_RAM), "snapshot size mismatch");
+
+// Copy the current video state, so that it can be rendered with
+// video_render_snapshot() while the emulation goes on. The dirty maps of
+// the snapshot are the changes since the previous snapshot.
+void video_snapshot(void) {
+	memcpy(snap_vram, VIDEO_RAM, sizeof(VIDEO_RAM));
+	memcpy(snap_vram_dirty, VIDEO_RAM_DIRTY, sizeof(VIDEO_RAM_DIRTY));
+	memcpy(snap_pal, PALETTE_RAM, sizeof(PALETTE_RAM));
+	memcpy(snap_pal_dirty, PALETTE_RAM_DIRTY, sizeof(PALETTE_RAM_DIRTY));
+	video_state_latch(&video_snap);
+	video_dirty_reset(false);
+}
+
+void video_render_snapshot(void) {
+	video_render_state(&video_snap);
+}
+#endif
+
 void video_palette_w(uint32_t address, uint32_t val, int sz) {
 	if (sz == 4) {
 		video_palette_w(address+0, val >> 16, 2);
@@ -221,6 +429,7 @@ void video_palette_w(uint32_t address, uint32_t val, int sz) {
 	address /= 2;
 	address += PALETTE_RAM_BANK;
 	PALETTE_RAM[address] = val;
+	PALETTE_RAM_DIRTY[address / 16] = 1;
 }
 
 uint32_t video_palette_r(uint32_t address, int sz) {
@@ -1,7 +1,20 @@
 #ifndef VIDEO_H
 #define VIDEO_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "hw.h"
+
 void video_render(void);
+void video_dirty_reset(bool dirty);
+
+#ifndef N64
+// Pipelined rendering: video_snapshot() copies the video state at the end of
+// a frame, and video_render_snapshot() draws it (possibly on another thread,
+// while the emulation runs the next frame). Don't mix with video_render().
+void video_snapshot(void);
+void video_render_snapshot(void);
+#endif
 
 void video_palette_w(uint32_t address, uint32_t val, int sz);
 uint32_t video_palette_r(uint32_t address, int sz);
@@ -2,24 +2,39 @@
 static uint8_t hscale[16][16];
 static bool hscale_init = false;
 
+// The fix layer is retained across frames: fix_pixels holds the color index
+// of each pixel (palette*16 + color), and fix_alpha has a mask for each row
+// of each cell (bit 7 is the leftmost pixel). Only the cells that changed are
+// redrawn (see render_fix), then the layer is composited over the sprites.
+// Since colors are resolved while compositing, palette changes are free.
+#define FIX_RETAINED 1
+static uint8_t fix_pixels[224][320];
+static uint8_t fix_alpha[40*28][8];
+
 static void draw_sprite_fix(int spritenum, int palnum, int x, int y) {
 	const int w=8, h=8;
-	uint16_t *dst = (uint16_t*)g_screen_ptr + y*g_screen_pitch/2 + x;
 	uint8_t *src = srom_get_sprite(spritenum);
-	uint16_t *pal = PALETTE_RAM_EMU + palnum*16;
+	uint8_t *alpha = fix_alpha[(x/8)*28 + y/8];
 
 	for (int j=0;j<h;j++) {
-		uint16_t *l = dst;
+		uint8_t *l = &fix_pixels[y+j][x];
+		uint8_t a = 0;
 		for (int i=0;i<w;i+=2) {
 			uint8_t px = *src++;
-			if (px>>4) l[0] = pal[px>>4];
-			if (px&0xF) l[1] = pal[px&0xF];
-			l+=2;
+			l[i+0] = (palnum << 4) | (px >> 4);
+			l[i+1] = (palnum << 4) | (px & 0xF);
+			a = (a << 2) | ((px >> 4) ? 2 : 0) | ((px & 0xF) ? 1 : 0);
 		}
-		dst += g_screen_pitch/2;
+		alpha[j] = a;
 	}
 }
 
+static void clear_sprite_fix(int x, int y) {
+	memset(fix_alpha[(x/8)*28 + y/8], 0, 8);
+}
+
+#include "video_cpu_blit.c"
+
 static void render_begin_sprites(void) {
 	if (!hscale_init) {	
 		const uint64_t hbits = 0x5b1d7f39a06e2c48ull;
@@ -28,70 +43,154 @@ static void render_begin_sprites(void) {
 			for (int x=y; x>=0; x--)
 				hscale[y][(hbits>>(4*x))&0xF] = 1;
 		hscale_init = true;
+		blit_init();
 	}
 }
 
 static void render_end_sprites(void) {}
 
+// Sprites of the current frame, with their tiles (see draw_sprite_list)
+static const SpriteCmd *frame_sprites;
+static const SpriteDecoded **frame_tiles;
+static int frame_sprites_len, frame_tiles_cap;
+
+static void draw_sprite_list(const SpriteCmd *list, int n) {
+	// Sprites are drawn later by render_bands(). Look up the tiles now, as
+	// the tile cache can only be used from this thread. Tiles used in the
+	// current frame are never evicted, so the pointers stay valid.
+	if (n > frame_tiles_cap) {
+		frame_tiles_cap = n * 2;
+		frame_tiles = realloc(frame_tiles, frame_tiles_cap * sizeof(SpriteDecoded*));
+		assertf(frame_tiles, "memory allocation failed");
+	}
+	for (int i=0; i<n; i++)
+		frame_tiles[i] = crom_get_sprite_decoded(list[i].tile);
 
-static void draw_sprite(int spritenum, int palnum, int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
-	const int w = 16, h = 16; 
-	uint8_t *src = crom_get_sprite(spritenum);
-	uint16_t *pal = PALETTE_RAM_EMU + palnum*16;
+	frame_sprites = list;
+	frame_sprites_len = n;
+}
 
-	int src_y_inc = w/2, src_x_inc = 1, src_bpp_flip=0;
-	if (flipy) {
-		src += w*(h-1)/2;
-		src_y_inc = -src_y_inc;
-	}
-	if (flipx) {
-		src += w/2-1;
-		src_x_inc = -1;
-		src_bpp_flip = 1;
+static void render_begin_fix(void) {}
+
+static void render_end_fix(void) {}
+
+// The frame is drawn in horizontal bands, which are independent of each
+// other: each band draws the background, the whole sprite list (in order,
+// so priorities are preserved) and the fix layer, clipped to its lines.
+// On PC, bands are drawn in parallel by a pool of worker threads.
+#define RENDER_BANDS        8
+#define RENDER_BAND_HEIGHT  (224 / RENDER_BANDS)
+
+static void render_band(int band) {
+	uint16_t *screen = (uint16_t*)g_screen_ptr;
+	int pitch = g_screen_pitch/2;
+	int ymin = band * RENDER_BAND_HEIGHT, ymax = ymin + RENDER_BAND_HEIGHT;
+
+	uint16_t bg = palette_emu[0xFFF];
+	for (int y=ymin;y<ymax;y++)
+		for (int x=0;x<320;x++)
+			screen[y*pitch + x] = bg;
+
+	for (int i=0; i<frame_sprites_len; i++) {
+		const SpriteCmd *c = &frame_sprites[i];
+		draw_tile(screen, pitch, ymin, ymax, frame_tiles[i], palette_emu + c->pal*16,
+			c->x, c->y, c->w, c->h, c->flags & SPRITE_FLIPX, c->flags & SPRITE_FLIPY);
 	}
 
-	int y = y0;
-	for (int j=0;j<h;j++) {
-		if (vshrink_line_drawn(sh, j)) {
-			y &= 511;
-			if (y >= 0 && y < 224) {
-				int x = x0 & 511;
-				uint16_t *l = (uint16_t*)g_screen_ptr + y*g_screen_pitch/2;
-				uint8_t *srcline = src;
-				uint8_t *hs = hscale[sw-1];
-
-				for (int i=0;i<w;i++) {
-					if (!hs[i]) continue;
-					uint8_t px = (i^src_bpp_flip)&1 ? srcline[i/2*src_x_inc]&0xF : srcline[i/2*src_x_inc]>>4;
-					if (px && x>=0 && x<320) l[x] = pal[px];
-					x++; x&=511;
-				}
+	// Composite the fix layer
+	for (int y=ymin;y<ymax;y++) {
+		uint16_t *line = screen + y*pitch;
+		for (int x=0;x<320;x+=8) {
+			uint8_t a = fix_alpha[(x/8)*28 + y/8][y%8];
+			uint8_t *src = &fix_pixels[y][x];
+			uint16_t *dst = line + x;
+
+			if (a == 0xFF) {
+				for (int i=0;i<8;i++)
+					dst[i] = palette_emu[src[i]];
+			} else if (a) {
+				for (int i=0;i<8;i++)
+					if (a & (0x80 >> i)) dst[i] = palette_emu[src[i]];
 			}
-			y++;
 		}
-		src += src_y_inc;
 	}
 }
 
-static void render_begin_fix(void) {}
-static void render_end_fix(void) {}
+#ifndef N64
+static int render_threads = -1;          // number of worker threads (-1: not started)
+static SDL_sem *render_start, *render_done;
+static SDL_atomic_t render_next_band;
 
-static void render_begin(void) {
-	for (int i=0; i<4096; i++) {
-		uint16_t val = PALETTE_RAM[PALETTE_RAM_BANK + i];
-		uint16_t c16 = color_convert(val);
+static void render_bands_run(void) {
+	int band;
+	while ((band = SDL_AtomicAdd(&render_next_band, 1)) < RENDER_BANDS)
+		render_band(band);
+}
 
-		// All colors but index 0 of each palette have alpha set to 1.
-		if (i & 15) c16 |= 1;
+static int render_worker(void *arg) {
+	while (1) {
+		SDL_SemWait(render_start);
+		render_bands_run();
+		SDL_SemPost(render_done);
+	}
+	return 0;
+}
 
-		PALETTE_RAM_EMU[i] = c16;
+// Start the worker threads: one less than the number of cores, as this
+// thread draws bands too. MVS64_RENDER_THREADS can override it (0 draws the
+// whole frame on this thread).
+static void render_threads_init(void) {
+	const char *env = getenv("MVS64_RENDER_THREADS");
+	render_threads = env && *env ? atoi(env) : SDL_GetCPUCount() - 1;
+	if (render_threads < 0) render_threads = 0;
+	if (render_threads > RENDER_BANDS-1) render_threads = RENDER_BANDS-1;
+
+	render_start = SDL_CreateSemaphore(0);
+	render_done = SDL_CreateSemaphore(0);
+	assertf(render_start && render_done, "cannot create semaphores: %s", SDL_GetError());
+	for (int i=0; i<render_threads; i++) {
+		SDL_Thread *t = SDL_CreateThread(render_worker, "render", NULL);
+		assertf(t, "cannot create render thread: %s", SDL_GetError());
+		SDL_DetachThread(t);
 	}
+	debugf("[VIDEO] render threads: %d\n", render_threads);
+}
+#endif
+
+static void render_bands(void) {
+	#ifndef N64
+	if (render_threads < 0)
+		render_threads_init();
+
+	SDL_AtomicSet(&render_next_band, 0);
+	for (int i=0; i<render_threads; i++)
+		SDL_SemPost(render_start);
+	render_bands_run();
+	for (int i=0; i<render_threads; i++)
+		SDL_SemWait(render_done);
+	#else
+	for (int band=0; band<RENDER_BANDS; band++)
+		render_band(band);
+	#endif
+}
 
-	uint16_t *screen = (uint16_t*)g_screen_ptr;
-	for (int y=0;y<224;y++)
-		for (int x=0;x<320;x++)
-			screen[y*g_screen_pitch/2 + x] = PALETTE_RAM_EMU[0xFFF];
+static void render_begin(void) {
+	// Convert the palettes changed since the last frame, in both banks
+	for (int p=0; p<8*1024/16; p++) {
+		if (!vs->pal_dirty[p]) continue;
+		for (int i=p*16; i<p*16+16; i++) {
+			uint16_t val = vs->pal[i];
+			uint16_t c16 = color_convert(val);
+
+			// All colors but index 0 of each palette have alpha set to 1.
+			if (i & 15) c16 |= 1;
+
+			PALETTE_RAM_EMU[i] = c16;
+		}
+	}
 }
 
-static void render_end(void) {}
+static void render_end(void) {
+	render_bands();
+}
 
@@ -0,0 +1,476 @@
+// Tile blitters for the CPU renderer.
+//
+// Tiles are drawn from the decoded tile cache (see SpriteDecoded): 16x16
+// pixels, one color index per byte. Each drawn row is compacted to the shrunk
+// width (see hscale), converted through the palette and composited over the
+// screen, where color 0 is transparent. Fully transparent tiles are skipped,
+// and fully opaque ones are stored without blending when possible.
+//
+// Tiles are clipped to the lines [ymin, ymax) of the screen, so that the
+// frame can be drawn in horizontal bands.
+//
+// Besides the scalar version, there are SIMD versions that process a whole
+// row with byte shuffles: compaction and flipping are a single shuffle
+// (hscale_shuf), and the palette is split in two 16-byte tables (low and
+// high bytes of each color) for the lookup.
+//
+// Each version has variants for the different kinds of tiles, selected once
+// per tile by draw_tile():
+//   * full: 16x16 tile, not flipped and fully within the clipping area.
+//     This is by far the most common case, and has no branches besides the
+//     row loop.
+//   * unclipped: any size or flip, fully within the clipping area. The scalar
+//     version has one variant per width and horizontal flip, generated by
+//     DRAW_TILE_SCALAR_UNCLIPPED.
+//   * clipped: anything else (clipped by the screen borders or the band, or
+//     wrapping around). Rows clipped on the right are drawn by the scalar
+//     version.
+//
+// The blitter is selected at runtime by blit_init(), which also checks that
+// it draws exactly the same pixels as the clipped scalar version. The
+// environment variable MVS64_BLITTER can force one (scalar, ssse3, avx2, neon).
+//
+// SSE2 alone has no byte shuffle, so SSSE3 is the baseline on x86.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLIT_NEON 1
+#endif
+
+typedef void (*DrawTileFunc)(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy);
+
+// Same as hscale, as a bitmask of the pixels drawn for each width. This is
+// used to generate the scalar variants at compile time (checked against
+// hscale by blit_init).
+static const uint16_t hscale_mask[16] = {
+	0x0100, 0x0110, 0x1110, 0x1114, 0x5114, 0x5154, 0x5155, 0x5555,
+	0x5755, 0x575D, 0xD75D, 0xD7DD, 0xF7DD, 0xF7DF, 0xFFDF, 0xFFFF,
+};
+
+// For each flip and horizontal shrink, the source pixels of the shrunk row in
+// drawing order. Unused lanes are 0x80, which makes the shuffles produce 0
+// (transparent).
+static uint8_t hscale_shuf[2][16][16] __attribute__((aligned(16)));
+
+// For each tile height, bitmask of the lines that are drawn (see
+// vshrink_line_drawn).
+static uint16_t vshrink_mask[17];
+
+// Loop through the lines of a tile, and run the row blitter (the variadic
+// argument) on each line drawn within [ymin, ymax), given the vertical
+// shrink. The row blitter can use line (screen line), row (source row), sy
+// (source row number) and x (wrapped X).
+#define DRAW_TILE_LINES(...) do { \
+	int y = y0, x = x0 & 511, flip = flipy ? 15 : 0; \
+	for (int j=0;j<16;j++) { \
+		if (vshrink_line_drawn(sh, j)) { \
+			y &= 511; \
+			if (y >= ymin && y < ymax) { \
+				int sy = j ^ flip; \
+				const uint8_t *row = tile->pix[sy]; \
+				uint16_t *line = screen + y*pitch; \
+				__VA_ARGS__; \
+			} \
+			y++; \
+		} \
+	} \
+} while (0)
+
+// Same as DRAW_TILE_LINES, for a tile fully within the clipping area. Here
+// line points directly to the first pixel of the tile.
+#define DRAW_TILE_LINES_UNCLIPPED(...) do { \
+	int flip = flipy ? 15 : 0; \
+	uint16_t *line = screen + (y0 & 511)*pitch + (x0 & 511); \
+	for (unsigned m = vshrink_mask[sh]; m; m &= m-1, line += pitch) { \
+		int sy = __builtin_ctz(m) ^ flip; \
+		const uint8_t *row = tile->pix[sy]; \
+		__VA_ARGS__; \
+	} \
+} while (0)
+
+// Same as DRAW_TILE_LINES, for a 16x16 tile fully within the clipping area
+// and not flipped.
+#define DRAW_TILE_LINES_FULL(...) do { \
+	uint16_t *line = screen + (y0 & 511)*pitch + (x0 & 511); \
+	for (int sy = 0; sy < 16; sy++, line += pitch) { \
+		const uint8_t *row = tile->pix[sy]; \
+		__VA_ARGS__; \
+	} \
+} while (0)
+
+static inline void blit_row_scalar(uint16_t *line, const uint8_t *row, const uint16_t *pal, int x, int sw, bool flipx) {
+	const uint8_t *hs = hscale[sw-1];
+
+	for (int i=0;i<16;i++) {
+		if (!hs[i]) continue;
+		uint8_t px = row[flipx ? 15-i : i];
+		if (px && x<320) line[x] = pal[px];
+		x++; x&=511;
+	}
+}
+
+static void draw_tile_scalar(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	DRAW_TILE_LINES(blit_row_scalar(line, row, pal, x, sw, flipx));
+}
+
+// Draw a row of a tile fully on screen, with the width and flip known at
+// compile time: the loop is unrolled, and transparency is a mask rather than
+// a branch. Rows that are fully transparent are skipped.
+__attribute__((always_inline))
+static inline void blit_row_scalar_fixed(uint16_t *l, const uint8_t *row, uint16_t row_opaque, const uint16_t *pal, const int sw, const bool flipx) {
+	const unsigned mask = hscale_mask[sw-1];
+	int x = 0;
+
+	if (!row_opaque) return;
+
+	#pragma GCC unroll 16
+	for (int i=0;i<16;i++) {
+		if (!(mask & (1u<<i))) continue;
+		uint8_t px = row[flipx ? 15-i : i];
+		uint16_t opaque = -(uint16_t)(px != 0);
+		l[x] = (pal[px] & opaque) | (l[x] & ~opaque);
+		x++;
+	}
+}
+
+#define DRAW_TILE_SCALAR_UNCLIPPED(sw, fx) \
+	static void draw_tile_scalar_##sw##_##fx(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal, \
+		int x0, int y0, int sw_, int sh, bool flipx, bool flipy) { \
+		DRAW_TILE_LINES_UNCLIPPED(blit_row_scalar_fixed(line, row, tile->opaque[sy], pal, sw, fx)); \
+	}
+#define DRAW_TILE_SCALAR_UNCLIPPED_ALL(fx) \
+	DRAW_TILE_SCALAR_UNCLIPPED(1, fx)  DRAW_TILE_SCALAR_UNCLIPPED(2, fx)  DRAW_TILE_SCALAR_UNCLIPPED(3, fx)  DRAW_TILE_SCALAR_UNCLIPPED(4, fx) \
+	DRAW_TILE_SCALAR_UNCLIPPED(5, fx)  DRAW_TILE_SCALAR_UNCLIPPED(6, fx)  DRAW_TILE_SCALAR_UNCLIPPED(7, fx)  DRAW_TILE_SCALAR_UNCLIPPED(8, fx) \
+	DRAW_TILE_SCALAR_UNCLIPPED(9, fx)  DRAW_TILE_SCALAR_UNCLIPPED(10, fx) DRAW_TILE_SCALAR_UNCLIPPED(11, fx) DRAW_TILE_SCALAR_UNCLIPPED(12, fx) \
+	DRAW_TILE_SCALAR_UNCLIPPED(13, fx) DRAW_TILE_SCALAR_UNCLIPPED(14, fx) DRAW_TILE_SCALAR_UNCLIPPED(15, fx) DRAW_TILE_SCALAR_UNCLIPPED(16, fx)
+
+DRAW_TILE_SCALAR_UNCLIPPED_ALL(0)
+DRAW_TILE_SCALAR_UNCLIPPED_ALL(1)
+
+#define DRAW_TILE_SCALAR_UNCLIPPED_TABLE(fx) { \
+	draw_tile_scalar_1_##fx,  draw_tile_scalar_2_##fx,  draw_tile_scalar_3_##fx,  draw_tile_scalar_4_##fx, \
+	draw_tile_scalar_5_##fx,  draw_tile_scalar_6_##fx,  draw_tile_scalar_7_##fx,  draw_tile_scalar_8_##fx, \
+	draw_tile_scalar_9_##fx,  draw_tile_scalar_10_##fx, draw_tile_scalar_11_##fx, draw_tile_scalar_12_##fx, \
+	draw_tile_scalar_13_##fx, draw_tile_scalar_14_##fx, draw_tile_scalar_15_##fx, draw_tile_scalar_16_##fx, \
+}
+
+static const DrawTileFunc draw_tile_scalar_unclipped[2][16] = {
+	DRAW_TILE_SCALAR_UNCLIPPED_TABLE(0),
+	DRAW_TILE_SCALAR_UNCLIPPED_TABLE(1),
+};
+
+static void draw_tile_scalar_full(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	if (tile->flags & SPRITE_DECODED_OPAQUE)
+		DRAW_TILE_LINES_FULL(for (int i=0;i<16;i++) line[i] = pal[row[i]]);
+	else
+		DRAW_TILE_LINES_FULL(blit_row_scalar_fixed(line, row, tile->opaque[sy], pal, 16, false));
+}
+
+#if BLIT_X86
+__attribute__((target("ssse3")))
+static inline void blit_pal_ssse3(const uint16_t *pal, __m128i *pal_lo, __m128i *pal_hi) {
+	__m128i p0 = _mm_loadu_si128((const __m128i*)pal);
+	__m128i p1 = _mm_loadu_si128((const __m128i*)(pal+8));
+	__m128i lo = _mm_set1_epi16(0xFF);
+	*pal_lo = _mm_packus_epi16(_mm_and_si128(p0, lo), _mm_and_si128(p1, lo));
+	*pal_hi = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+}
+
+// Draw 16 pixels, given their color indices. If opaque is true, all pixels
+// must be non-transparent.
+__attribute__((target("ssse3"), always_inline))
+static inline void blit_row_ssse3(uint16_t *l, __m128i idx, __m128i pal_lo, __m128i pal_hi, const bool opaque) {
+	__m128i clo = _mm_shuffle_epi8(pal_lo, idx);
+	__m128i chi = _mm_shuffle_epi8(pal_hi, idx);
+	__m128i c0 = _mm_unpacklo_epi8(clo, chi), c1 = _mm_unpackhi_epi8(clo, chi);
+
+	if (!opaque) {
+		__m128i transp = _mm_cmpeq_epi8(idx, _mm_setzero_si128());
+		__m128i m0 = _mm_unpacklo_epi8(transp, transp), m1 = _mm_unpackhi_epi8(transp, transp);
+		__m128i d0 = _mm_loadu_si128((const __m128i*)l), d1 = _mm_loadu_si128((const __m128i*)(l+8));
+		c0 = _mm_or_si128(_mm_and_si128(m0, d0), _mm_andnot_si128(m0, c0));
+		c1 = _mm_or_si128(_mm_and_si128(m1, d1), _mm_andnot_si128(m1, c1));
+	}
+	_mm_storeu_si128((__m128i*)l,     c0);
+	_mm_storeu_si128((__m128i*)(l+8), c1);
+}
+
+#define LOAD_ROW_SSSE3(row)   _mm_loadu_si128((const __m128i*)(row))
+
+__attribute__((target("ssse3")))
+static void draw_tile_ssse3(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	__m128i pal_lo, pal_hi;
+	__m128i shuf = _mm_load_si128((const __m128i*)hscale_shuf[flipx][sw-1]);
+	blit_pal_ssse3(pal, &pal_lo, &pal_hi);
+
+	DRAW_TILE_LINES(
+		if (x + 16 <= 320) blit_row_ssse3(line + x, _mm_shuffle_epi8(LOAD_ROW_SSSE3(row), shuf), pal_lo, pal_hi, false);
+		else blit_row_scalar(line, row, pal, x, sw, flipx));
+}
+
+__attribute__((target("ssse3")))
+static void draw_tile_ssse3_unclipped(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	__m128i pal_lo, pal_hi;
+	__m128i shuf = _mm_load_si128((const __m128i*)hscale_shuf[flipx][sw-1]);
+	blit_pal_ssse3(pal, &pal_lo, &pal_hi);
+
+	DRAW_TILE_LINES_UNCLIPPED(blit_row_ssse3(line, _mm_shuffle_epi8(LOAD_ROW_SSSE3(row), shuf), pal_lo, pal_hi, false));
+}
+
+__attribute__((target("ssse3")))
+static void draw_tile_ssse3_full(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	__m128i pal_lo, pal_hi;
+	blit_pal_ssse3(pal, &pal_lo, &pal_hi);
+
+	if (tile->flags & SPRITE_DECODED_OPAQUE)
+		DRAW_TILE_LINES_FULL(blit_row_ssse3(line, LOAD_ROW_SSSE3(row), pal_lo, pal_hi, true));
+	else
+		DRAW_TILE_LINES_FULL(blit_row_ssse3(line, LOAD_ROW_SSSE3(row), pal_lo, pal_hi, false));
+}
+
+// Same as blit_row_ssse3
+__attribute__((target("avx2"), always_inline))
+static inline void blit_row_avx2(uint16_t *l, __m128i idx, __m128i pal_lo, __m128i pal_hi, const bool opaque) {
+	__m128i clo = _mm_shuffle_epi8(pal_lo, idx);
+	__m128i chi = _mm_shuffle_epi8(pal_hi, idx);
+	__m256i c = _mm256_or_si256(_mm256_cvtepu8_epi16(clo), _mm256_slli_epi16(_mm256_cvtepu8_epi16(chi), 8));
+
+	if (!opaque) {
+		__m256i m = _mm256_cvtepi8_epi16(_mm_cmpeq_epi8(idx, _mm_setzero_si128()));
+		c = _mm256_blendv_epi8(c, _mm256_loadu_si256((const __m256i*)l), m);
+	}
+	_mm256_storeu_si256((__m256i*)l, c);
+}
+
+__attribute__((target("avx2")))
+static void draw_tile_avx2(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	__m128i pal_lo, pal_hi;
+	__m128i shuf = _mm_load_si128((const __m128i*)hscale_shuf[flipx][sw-1]);
+	blit_pal_ssse3(pal, &pal_lo, &pal_hi);
+
+	DRAW_TILE_LINES(
+		if (x + 16 <= 320) blit_row_avx2(line + x, _mm_shuffle_epi8(LOAD_ROW_SSSE3(row), shuf), pal_lo, pal_hi, false);
+		else blit_row_scalar(line, row, pal, x, sw, flipx));
+}
+
+__attribute__((target("avx2")))
+static void draw_tile_avx2_unclipped(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	__m128i pal_lo, pal_hi;
+	__m128i shuf = _mm_load_si128((const __m128i*)hscale_shuf[flipx][sw-1]);
+	blit_pal_ssse3(pal, &pal_lo, &pal_hi);
+
+	DRAW_TILE_LINES_UNCLIPPED(blit_row_avx2(line, _mm_shuffle_epi8(LOAD_ROW_SSSE3(row), shuf), pal_lo, pal_hi, false));
+}
+
+__attribute__((target("avx2")))
+static void draw_tile_avx2_full(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	__m128i pal_lo, pal_hi;
+	blit_pal_ssse3(pal, &pal_lo, &pal_hi);
+
+	if (tile->flags & SPRITE_DECODED_OPAQUE)
+		DRAW_TILE_LINES_FULL(blit_row_avx2(line, LOAD_ROW_SSSE3(row), pal_lo, pal_hi, true));
+	else
+		DRAW_TILE_LINES_FULL(blit_row_avx2(line, LOAD_ROW_SSSE3(row), pal_lo, pal_hi, false));
+}
+#endif
+
+#if BLIT_NEON
+// Same as blit_row_ssse3
+__attribute__((always_inline))
+static inline void blit_row_neon(uint16_t *l, uint8x16_t idx, uint8x16x2_t pal, const bool opaque) {
+	uint8x16_t clo = vqtbl1q_u8(pal.val[0], idx);
+	uint8x16_t chi = vqtbl1q_u8(pal.val[1], idx);
+	uint16x8_t c0 = vreinterpretq_u16_u8(vzip1q_u8(clo, chi)), c1 = vreinterpretq_u16_u8(vzip2q_u8(clo, chi));
+
+	if (!opaque) {
+		uint8x16_t transp = vceqq_u8(idx, vdupq_n_u8(0));
+		uint16x8_t m0 = vreinterpretq_u16_u8(vzip1q_u8(transp, transp)), m1 = vreinterpretq_u16_u8(vzip2q_u8(transp, transp));
+		c0 = vbslq_u16(m0, vld1q_u16(l),   c0);
+		c1 = vbslq_u16(m1, vld1q_u16(l+8), c1);
+	}
+	vst1q_u16(l,   c0);
+	vst1q_u16(l+8, c1);
+}
+
+static void draw_tile_neon(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	// Deinterleave the low and high bytes of the colors
+	uint8x16x2_t p = vld2q_u8((const uint8_t*)pal);
+	uint8x16_t shuf = vld1q_u8(hscale_shuf[flipx][sw-1]);
+
+	DRAW_TILE_LINES(
+		if (x + 16 <= 320) blit_row_neon(line + x, vqtbl1q_u8(vld1q_u8(row), shuf), p, false);
+		else blit_row_scalar(line, row, pal, x, sw, flipx));
+}
+
+static void draw_tile_neon_unclipped(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	uint8x16x2_t p = vld2q_u8((const uint8_t*)pal);
+	uint8x16_t shuf = vld1q_u8(hscale_shuf[flipx][sw-1]);
+
+	DRAW_TILE_LINES_UNCLIPPED(blit_row_neon(line, vqtbl1q_u8(vld1q_u8(row), shuf), p, false));
+}
+
+static void draw_tile_neon_full(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	uint8x16x2_t p = vld2q_u8((const uint8_t*)pal);
+
+	if (tile->flags & SPRITE_DECODED_OPAQUE)
+		DRAW_TILE_LINES_FULL(blit_row_neon(line, vld1q_u8(row), p, true));
+	else
+		DRAW_TILE_LINES_FULL(blit_row_neon(line, vld1q_u8(row), p, false));
+}
+#endif
+
+typedef struct {
+	const char *name;
+	DrawTileFunc clipped;
+	DrawTileFunc unclipped;  // NULL: use the scalar variants
+	DrawTileFunc full;
+} TileBlitter;
+
+static const TileBlitter tile_blitters[] = {
+	#if BLIT_X86
+	{ "avx2", draw_tile_avx2, draw_tile_avx2_unclipped, draw_tile_avx2_full },
+	{ "ssse3", draw_tile_ssse3, draw_tile_ssse3_unclipped, draw_tile_ssse3_full },
+	#endif
+	#if BLIT_NEON
+	{ "neon", draw_tile_neon, draw_tile_neon_unclipped, draw_tile_neon_full },
+	#endif
+	{ "scalar", draw_tile_scalar, NULL, draw_tile_scalar_full },
+};
+
+// Variants of the selected blitter
+static DrawTileFunc draw_tile_clipped = draw_tile_scalar;
+static DrawTileFunc draw_tile_full = draw_tile_scalar_full;
+static DrawTileFunc draw_tile_unclipped[2][16];
+
+static void draw_tile(uint16_t *screen, int pitch, int ymin, int ymax, const SpriteDecoded *tile, const uint16_t *pal,
+	int x0, int y0, int sw, int sh, bool flipx, bool flipy) {
+	DrawTileFunc f = draw_tile_clipped;
+	int y = y0 & 511;
+
+	if (tile->flags & SPRITE_DECODED_TRANSPARENT)
+		return;
+
+	// Skip tiles outside of the clipping area (considering that they might
+	// wrap around to the top of the screen)
+	if ((y >= ymax || y + sh <= ymin) && y + sh - 512 <= ymin)
+		return;
+
+	// The SIMD versions always write 16 pixels, so check the whole tile
+	// even if it is shrunk.
+	if ((x0 & 511) + 16 <= 320 && y >= ymin && y + sh <= ymax) {
+		if (sw == 16 && sh == 16 && !flipx && !flipy)
+			f = draw_tile_full;
+		else
+			f = draw_tile_unclipped[flipx][sw-1];
+	}
+	f(screen, pitch, ymin, ymax, tile, pal, x0, y0, sw, sh, flipx, flipy);
+}
+
+static void blit_select(const TileBlitter *b) {
+	draw_tile_clipped = b->clipped;
+	draw_tile_full = b->full;
+	for (int f=0;f<2;f++)
+		for (int sw=0;sw<16;sw++)
+			draw_tile_unclipped[f][sw] = b->unclipped ? b->unclipped : draw_tile_scalar_unclipped[f][sw];
+}
+
+// Draw random tiles with the selected blitter and the clipped scalar version,
+// and check that they produce the same pixels.
+static bool blit_selftest(void) {
+	uint16_t *a = calloc(2*320*224, sizeof(uint16_t)), *b = a + 320*224;
+	SpriteDecoded *tile = malloc(sizeof(SpriteDecoded));
+	uint8_t src[128]; uint16_t pal[16];
+	uint32_t seed = 0x12345678;
+	bool ok = true;
+	assertf(a && tile, "memory allocation failed");
+
+	#define RND() (seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5, seed)
+	for (int iter=0; iter<1024 && ok; iter++) {
+		for (int i=0;i<128;i++) src[i] = RND();
+		for (int i=0;i<16;i++) pal[i] = RND();
+		int x0 = RND() % 512, y0 = RND() % 512 - 16;
+		int sw = RND() % 16 + 1, sh = RND() % 17;
+		bool flipx = RND() & 1, flipy = RND() & 1;
+		if (iter & 1) {
+			// Mostly full tiles fully on screen
+			x0 = RND() % 320; y0 = RND() % 224;
+			if (iter & 2) { sw = sh = 16; flipx = flipy = false; }
+		}
+		if (iter % 8 == 3)  // fully opaque
+			for (int i=0;i<128;i++) src[i] |= 0x11;
+		if (iter % 64 == 7) // fully transparent
+			memset(src, 0, 128);
+		sprite_decode(tile, src);
+
+		// Clip to a band of the screen, sometimes
+		int ymin = 0, ymax = 224;
+		if (iter % 4 == 2) {
+			ymin = RND() % 224;
+			ymax = ymin + RND() % (224 - ymin) + 1;
+		}
+
+		draw_tile(a, 320, ymin, ymax, tile, pal, x0, y0, sw, sh, flipx, flipy);
+		draw_tile_scalar(b, 320, ymin, ymax, tile, pal, x0, y0, sw, sh, flipx, flipy);
+		ok = !memcmp(a, b, 320*224*sizeof(uint16_t));
+	}
+	#undef RND
+
+	free(tile);
+	free(a);
+	return ok;
+}
+
+static void blit_init(void) {
+	for (int sw=1;sw<=16;sw++) {
+		for (int i=0;i<16;i++)
+			assert(hscale[sw-1][i] == ((hscale_mask[sw-1] >> i) & 1));
+		for (int f=0;f<2;f++) {
+			uint8_t *shuf = hscale_shuf[f][sw-1];
+			int n = 0;
+			memset(shuf, 0x80, 16);
+			for (int i=0;i<16;i++)
+				if (hscale[sw-1][i])
+					shuf[n++] = f ? 15-i : i;
+		}
+	}
+	for (int sh=0;sh<=16;sh++) {
+		vshrink_mask[sh] = 0;
+		for (int j=0;j<16;j++)
+			if (vshrink_line_drawn(sh, j))
+				vshrink_mask[sh] |= 1 << j;
+	}
+
+	const char *force = getenv("MVS64_BLITTER");
+	if (force && !*force) force = NULL;
+
+	#if BLIT_X86
+	__builtin_cpu_init();
+	#endif
+	for (int i=0; i<sizeof(tile_blitters)/sizeof(tile_blitters[0]); i++) {
+		const TileBlitter *b = &tile_blitters[i];
+		if (force && strcmp(force, b->name)) continue;
+		#if BLIT_X86
+		if (b->clipped == draw_tile_avx2 && !__builtin_cpu_supports("avx2")) continue;
+		if (b->clipped == draw_tile_ssse3 && !__builtin_cpu_supports("ssse3")) continue;
+		#endif
+		blit_select(b);
+		assertf(blit_selftest(), "%s blitter does not match the reference one (draw_tile_scalar)", b->name);
+		debugf("[VIDEO] tile blitter: %s\n", b->name);
+		break;
+	}
+}
@@ -4,6 +4,9 @@
 #define RSP_FIX_LAYER    1
 #define RSP_SPRITES      1
 
+// The fix layer is drawn from scratch every frame
+#define FIX_RETAINED     0
+
 extern uint32_t RSP_OVL_ID;
 
 static void rsp_fix_init(void) {
@@ -42,7 +45,7 @@ static void draw_sprite(int spritenum, int palnum, int x0, int y0, int sw, int s
 		return;
 	}
 
-	uint16_t *pal = PALETTE_RAM_EMU + palnum*16;
+	uint16_t *pal = palette_emu + palnum*16;
 	static const int16_t scale_fx[17] = { 0, (16<<10)/1, (16<<10)/2, (16<<10)/3, (16<<10)/4, (16<<10)/5, (16<<10)/6, (16<<10)/7, (16<<10)/8, (16<<10)/9, (16<<10)/10, (16<<10)/11, (16<<10)/12, (16<<10)/13, (16<<10)/14, (16<<10)/15, (16<<10)/16 };
 
 	// Convert the coordinates from [0..511] to [-16..496]
@@ -130,7 +133,7 @@ static void render_begin_sprites(void) {
 	if (RSP_SPRITES) {
 		// rdpq_debug_log(true);
 		rdpq_debug_log_msg("render_begin_sprites");
-		rsp_sprite_begin(PALETTE_RAM_EMU);
+		rsp_sprite_begin(palette_emu);
 		rdpq_mode_begin();
 			rdpq_set_mode_standard();
 			rdpq_mode_tlut(TLUT_RGBA16);
@@ -147,6 +150,13 @@ static void render_begin_sprites(void) {
 	for (int i=0;i<16;i++) pal_slot_cache[i] = -1;
 }
 
+static void draw_sprite_list(const SpriteCmd *list, int n) {
+	for (int i=0; i<n; i++) {
+		const SpriteCmd *c = &list[i];
+		draw_sprite(c->tile, c->pal, c->x, c->y, c->w, c->h, c->flags & SPRITE_FLIPX, c->flags & SPRITE_FLIPY);
+	}
+}
+
 static void render_end_sprites(void) {
 	if (RSP_SPRITES) {
 		// rdpq_debug_log(false);
@@ -200,7 +210,7 @@ static void render_begin_fix(void) {
 
 	// Load all 16 palettes right away. They fit TMEM, so that we don't need
 	// to load them while we process
-	rdpq_tex_load_tlut(PALETTE_RAM_EMU, 0, 256);
+	rdpq_tex_load_tlut(palette_emu, 0, 256);
 
 	// Configure tiles once
 	rdpq_set_tile(TILE0, FMT_CI4, FIX_TMEM_ADDR, FIX_TMEM_PITCH, 0);  // used for drawing
@@ -217,12 +227,21 @@ static void render_begin_fix(void) {
 static void render_end_fix(void) {}
 
 static void render_begin(void) {
-	data_cache_hit_writeback(PALETTE_RAM + PALETTE_RAM_BANK, 4096*2);
-	for (int i=0; i<4096 / 0x400; i++) {
-		rsp_pal_convert(PALETTE_RAM + PALETTE_RAM_BANK + i*0x400, PALETTE_RAM_EMU + i*0x400);
+	// Convert the blocks of 0x400 colors (64 palettes) that were changed since
+	// the last frame, in both banks
+	for (int i=0; i<8*1024 / 0x400; i++) {
+		uint64_t any = 0;
+		for (int j=i*64; j<i*64+64; j+=8) {
+			uint64_t d; memcpy(&d, vs->pal_dirty + j, 8);
+			any |= d;
+		}
+		if (!any) continue;
+
+		data_cache_hit_writeback(vs->pal + i*0x400, 0x400*2);
+		rsp_pal_convert(vs->pal + i*0x400, PALETTE_RAM_EMU + i*0x400);
 	}
 
-	uint16_t bkg = color_convert(PALETTE_RAM[PALETTE_RAM_BANK+0xFFF]) | 1;
+	uint16_t bkg = color_convert(vs->pal[vs->pal_bank+0xFFF]) | 1;
 
 	// Clear the screen
 	// rdpq_debug_log(true);
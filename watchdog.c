@@ -10,7 +10,7 @@ static uint32_t watchdog_expired(void* arg) {
 	return WATCHDOG_PERIOD;
 }
 
-static void watchdog_kick(void) {
+static void watchdog_kick(uint32_t addr, uint32_t val, int sz) {
 	if (ACCURATE_WATCHDOG)
 		emu_change_event(watchdog_event, emu_clock() + WATCHDOG_PERIOD);
 	else
@@ -19,6 +19,7 @@ static void watchdog_kick(void) {
 
 static void watchdog_init(void) {
 	watchdog_event = emu_add_event(WATCHDOG_PERIOD, watchdog_expired, NULL);
+	mmio_register(0x300001, 1, NULL, watchdog_kick);
 }
 
 static void watchdog_vblank(void) {